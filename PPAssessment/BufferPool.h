@@ -0,0 +1,142 @@
+#pragma once
+
+class BufferPool;
+
+// A device buffer borrowed from a BufferPool, it goes back to the pool when it is destroyed.
+// It can be used anywhere a cl::Buffer can, but must not be copied into a plain cl::Buffer that outlives it because the pool will hand the buffer out again.
+// Commands already queued on the buffer still finish first, the queue is in order so the next user's commands always come after them.
+class PooledBuffer : public cl::Buffer {
+private:
+	BufferPool* Pool;
+	size_t BucketSize;
+
+public:
+	PooledBuffer() : Pool(nullptr), BucketSize(0) {}
+
+	PooledBuffer(BufferPool* pool, const cl::Buffer& buffer, const size_t bucketSize) : cl::Buffer(buffer), Pool(pool), BucketSize(bucketSize) {}
+
+	PooledBuffer(const PooledBuffer&) = delete;
+	PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+	PooledBuffer(PooledBuffer&& other) : cl::Buffer(other), Pool(other.Pool), BucketSize(other.BucketSize) {
+		other.Pool = nullptr;
+	}
+
+	PooledBuffer& operator=(PooledBuffer&& other) {
+		if (this != &other) {
+			Return();
+			cl::Buffer::operator=(other);
+			Pool = other.Pool;
+			BucketSize = other.BucketSize;
+			other.Pool = nullptr;
+		}
+		return *this;
+	}
+
+	~PooledBuffer() {
+		Return();
+	}
+
+private:
+	// Give the buffer back to the pool, defined after BufferPool.
+	void Return();
+};
+
+// Recycles device buffers between kernels, channels, images and modes so steady state processing doesn't allocate on the device.
+// Buffers are grouped into buckets by size, and a request is served by any free buffer from its bucket.
+// All pooled buffers are read-write so any buffer can be reused for any purpose.
+class BufferPool {
+private:
+	cl::Context Context;
+	map<size_t, vector<cl::Buffer>> FreeBuffers;
+	size_t Hits = 0;
+	size_t Misses = 0;
+	size_t BytesAllocated = 0;
+
+	// Sizes up to 1MB are rounded up to a power of two, larger ones to a whole number of megabytes so big images don't waste up to half their size.
+	static const size_t LargeBucketSize = 1024 * 1024;
+
+	static size_t GetBucketSize(const size_t size) {
+		if (size > LargeBucketSize) {
+			return ((size + LargeBucketSize - 1) / LargeBucketSize) * LargeBucketSize;
+		}
+		size_t bucketSize = 64;
+		while (bucketSize < size) {
+			bucketSize *= 2;
+		}
+		return bucketSize;
+	}
+
+public:
+	BufferPool(const cl::Context& context) : Context(context) {}
+
+	const cl::Context& GetContext() const {
+		return Context;
+	}
+
+	// Borrow a buffer of at least size bytes, reusing a free one from the same bucket when there is one.
+	PooledBuffer Acquire(const size_t size) {
+		const size_t bucketSize = GetBucketSize(size);
+
+		vector<cl::Buffer>& bucket = FreeBuffers[bucketSize];
+		if (!bucket.empty()) {
+			Hits++;
+			cl::Buffer buffer = bucket.back();
+			bucket.pop_back();
+			return PooledBuffer(this, buffer, bucketSize);
+		}
+
+		Misses++;
+		cl::Buffer buffer;
+		try {
+			buffer = cl::Buffer(Context, CL_MEM_READ_WRITE, bucketSize);
+		}
+		catch (const cl::Error& err) {
+			// Free buffers in other buckets may be what's using up the device, let them go and try once more.
+			if (err.err() != CL_MEM_OBJECT_ALLOCATION_FAILURE && err.err() != CL_OUT_OF_RESOURCES) {
+				throw;
+			}
+			Clear();
+			buffer = cl::Buffer(Context, CL_MEM_READ_WRITE, bucketSize);
+		}
+		BytesAllocated += bucketSize;
+		return PooledBuffer(this, buffer, bucketSize);
+	}
+
+	// Make a buffer over host memory for a device that uses it in place, see CanUseInPlace. It belongs to that memory so it never goes into the pool.
+	PooledBuffer WrapHostMemory(void* hostData, const size_t size, const cl_mem_flags flags) {
+		return PooledBuffer(nullptr, cl::Buffer(Context, flags | CL_MEM_USE_HOST_PTR, size, hostData), 0);
+	}
+
+	// Take a buffer back so it can be handed out again.
+	void Release(const cl::Buffer& buffer, const size_t bucketSize) {
+		FreeBuffers[bucketSize].push_back(buffer);
+	}
+
+	// Free every buffer not currently borrowed.
+	void Clear() {
+		for (const pair<const size_t, vector<cl::Buffer>>& bucket : FreeBuffers) {
+			BytesAllocated -= bucket.first * bucket.second.size();
+		}
+		FreeBuffers.clear();
+	}
+
+	// Describe how often buffers were reused and how much device memory the pool holds.
+	string GetStatistics() const {
+		stringstream sstream;
+		const size_t requests = Hits + Misses;
+		sstream << Hits << " hits, " << Misses << " misses";
+		if (requests > 0) {
+			sstream << " (" << (100 * Hits / requests) << "% reused)";
+		}
+		sstream << ", " << (BytesAllocated / 1024) << "KB allocated";
+		return sstream.str();
+	}
+};
+
+inline void PooledBuffer::Return() {
+	if (Pool != nullptr) {
+		Pool->Release(*this, BucketSize);
+		Pool = nullptr;
+	}
+}
\ No newline at end of file
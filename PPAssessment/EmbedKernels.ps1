@@ -0,0 +1,38 @@
+# Generates KernelSources.h, which holds the kernel sources as string literals so the program never reads the .cl files at runtime.
+# It is run by the pre-build event, the .cl files are still the ones to edit.
+param(
+	[string]$OutputFile = (Join-Path $PSScriptRoot "KernelSources.h")
+)
+
+# In the order they must be built, the shared kernels go first because they define the types used by the others.
+$kernelFiles = @("SharedKernels.cl", "RgbKernels.cl", "HslKernels.cl")
+
+# MSVC won't take a single string literal over 16380 characters, so sources are split on line boundaries into pieces the compiler joins back together.
+$maxPieceLength = 8000
+
+$output = New-Object System.Text.StringBuilder
+[void]$output.Append("// Generated by EmbedKernels.ps1 from the .cl files, do not edit.`n#pragma once`n`n")
+[void]$output.Append("static const size_t EmbeddedKernelCount = $($kernelFiles.Count);`n`n")
+[void]$output.Append("static const char* const EmbeddedKernelNames[] = { `"" + ($kernelFiles -join "`", `"") + "`" };`n`n")
+[void]$output.Append("static const char* const EmbeddedKernelSources[] = {`n")
+
+foreach ($file in $kernelFiles) {
+	$source = [System.IO.File]::ReadAllText((Join-Path $PSScriptRoot $file)).Replace("`r`n", "`n")
+	$piece = ""
+	foreach ($line in $source.Split("`n")) {
+		if ($piece.Length + $line.Length + 1 -gt $maxPieceLength) {
+			[void]$output.Append("R`"KERNEL($piece)KERNEL`"`n")
+			$piece = ""
+		}
+		$piece += $line + "`n"
+	}
+	[void]$output.Append("R`"KERNEL($piece)KERNEL`",`n")
+}
+
+[void]$output.Append("};`n")
+
+# Only write the header when a kernel has changed, so it doesn't force a rebuild every time.
+$text = $output.ToString()
+if (-not (Test-Path $OutputFile) -or [System.IO.File]::ReadAllText($OutputFile) -ne $text) {
+	[System.IO.File]::WriteAllText($OutputFile, $text)
+}
\ No newline at end of file
@@ -0,0 +1,75 @@
+#pragma once
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <stdlib.h>
+#endif
+
+// Allocates page-aligned host memory. A buffer made over it with CL_MEM_USE_HOST_PTR is used in place by devices that share memory with the host,
+// e.g. CPU runtimes or integrated GPUs, so nothing is copied to or from the device.
+template <typename T>
+class PageAlignedAllocator {
+public:
+	typedef T value_type;
+
+	static const size_t Alignment = 4096;
+
+	PageAlignedAllocator() {}
+
+	template <typename U>
+	PageAlignedAllocator(const PageAlignedAllocator<U>&) {}
+
+	T* allocate(const size_t count) {
+		// Some runtimes also need the size to be a whole number of cache lines before they will use the memory in place.
+		const size_t size = max<size_t>(64, ((count * sizeof(T) + 63) / 64) * 64);
+
+#ifdef _WIN32
+		void* data = _aligned_malloc(size, Alignment);
+#else
+		void* data = nullptr;
+		if (posix_memalign(&data, Alignment, size) != 0) {
+			data = nullptr;
+		}
+#endif
+		if (data == nullptr) {
+			throw bad_alloc();
+		}
+		return static_cast<T*>(data);
+	}
+
+	void deallocate(T* data, const size_t) {
+#ifdef _WIN32
+		_aligned_free(data);
+#else
+		free(data);
+#endif
+	}
+};
+
+template <typename T, typename U>
+bool operator==(const PageAlignedAllocator<T>&, const PageAlignedAllocator<U>&) {
+	return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const PageAlignedAllocator<T>&, const PageAlignedAllocator<U>&) {
+	return false;
+}
+
+// Host data the device can use in place when it shares memory with the host.
+template <typename T>
+using HostVector = vector<T, PageAlignedAllocator<T>>;
+
+// Check whether a buffer can be made over this memory and used in place, which needs the device to share memory with the host and the memory to be page aligned.
+inline bool CanUseInPlace(const cl::Device& device, const void* data) {
+	return device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() == CL_TRUE && reinterpret_cast<uintptr_t>(data) % PageAlignedAllocator<char>::Alignment == 0;
+}
+
+// Move an image's pixels into page-aligned storage and make the image share it, so the processors can hand its pixels straight to the device.
+// The storage must outlive the image. The image is attached explicitly rather than assigned, CImg only keeps an assigned image shared when built as C++11.
+template <typename PixelType>
+void MoveToHostMemory(CImg<PixelType>& image, HostVector<PixelType>& storage) {
+	storage.assign(image.begin(), image.end());
+	image.assign(storage.data(), image.width(), image.height(), image.depth(), image.spectrum(), true);
+}
\ No newline at end of file
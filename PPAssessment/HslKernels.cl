@@ -1,16 +1,20 @@
-kernel void histogramAtomicHsl(global const float* inputImage, global uint* histogram, const uint binSize) {
-	int id = get_global_id(0);
+// Launched with a global offset so it only covers the luminance plane of the HSL image.
+kernel void histogramAtomicHsl(global const float* inputImage, global count_t* histogram, const uint binSize) {
+	count_t id = get_global_id(0);
 
 	// Get the bin index, truncate towards zero.
 	uint binIndex = (uint)trunc(inputImage[id] / binSize);
 
 	// Atomically increment the value at this bin index.
-	atomic_inc(&histogram[binIndex]);
+	countAdd(&histogram[binIndex], 1);
 }
 
-kernel void normaliseToLutHsl(global const uint* inputHistogram, const uint maxValue, global float* outputHistogram) {
+kernel void normaliseToLutHsl(global const count_t* inputHistogram, global float* outputHistogram) {
 	int id = get_global_id(0);
 
+	// The histogram is cumulative, so the total is just the last value.
+	count_t maxValue = inputHistogram[get_global_size(0) - 1];
+
 	// Calculate the normalised value between 0 and 1. We cast to a double to avoid integer rounding occurring.
 	double normalised = (double)inputHistogram[id] / maxValue;
 	// Scale the normalised value back up.
@@ -18,17 +22,18 @@ kernel void normaliseToLutHsl(global const uint* inputHistogram, const uint maxV
 	outputHistogram[id] = scaled;
 }
 
-kernel void backprojectionHsl(global const float* inputImage, global const float* inputHistogram, global float* outputImage, const uint binSize) {
-	int id = get_global_id(0);
+// Replaces the luminance of every pixel in place. Launched with a global offset so it only covers the luminance plane of the HSL image.
+kernel void backprojectionHsl(global float* image, global const float* inputHistogram, const uint binSize) {
+	count_t id = get_global_id(0);
 
 	// Get the bin index, truncate towards zero.
-	uint binIndex = (uint)trunc(inputImage[id] / binSize);
+	uint binIndex = (uint)trunc(image[id] / binSize);
 
-	outputImage[id] = inputHistogram[binIndex];
+	image[id] = inputHistogram[binIndex];
 }
 
-kernel void RgbToHsl(global const ushort* inputImage, global float* outputImage, const ushort maxPixelValue, const uint imageSize) {
-	int id = get_global_id(0);
+kernel void RgbToHsl(global const ushort* inputImage, global float* outputImage, const ushort maxPixelValue, const count_t imageSize) {
+	count_t id = get_global_id(0);
 
 	// Get RGB values for this pixel.
 	// Normalise to a fraction of 1 - cast to avoid rounding issues.
@@ -94,8 +99,8 @@ kernel void RgbToHsl(global const ushort* inputImage, global float* outputImage,
 	outputImage[id + (imageSize * 2)] = l;
 }
 
-kernel void HslToRgb(global const float* inputImage, global ushort* outputImage, const ushort maxPixelValue, const uint imageSize) {
-	int id = get_global_id(0);
+kernel void HslToRgb(global const float* inputImage, global ushort* outputImage, const ushort maxPixelValue, const count_t imageSize) {
+	count_t id = get_global_id(0);
 
 	float h = inputImage[id];
 	float s = inputImage[id + imageSize];
@@ -0,0 +1,80 @@
+#pragma once
+
+// Creates each kernel of a program once and hands out the same kernel every time it is asked for, along with its work group info for the device.
+// Kernel arguments are captured when a kernel is enqueued, so a cached kernel can be set up and enqueued again straight away.
+// A cl::Kernel must not have its arguments set from two threads at once, so each host thread needs its own registry.
+class KernelRegistry {
+public:
+	// What the device reported for a kernel, it is only queried the first time the kernel is used.
+	struct WorkGroupInfo {
+		// The largest work group the kernel can be launched with.
+		size_t MaxSize;
+		// Work groups that are a multiple of this use the hardware fully, e.g. the warp or wavefront width.
+		size_t PreferredMultiple;
+		// Local memory the kernel uses itself, on top of any local arguments.
+		cl_ulong LocalMemSize;
+	};
+
+private:
+	struct Entry {
+		cl::Kernel Kernel;
+		WorkGroupInfo Info;
+	};
+
+	cl::Program Program;
+	cl::Device Device;
+	map<string, Entry> Entries;
+
+	Entry& GetEntry(const string& name) {
+		map<string, Entry>::iterator entry = Entries.find(name);
+		if (entry == Entries.end()) {
+			Entry created;
+			created.Kernel = cl::Kernel(Program, name.c_str());
+			created.Info.MaxSize = created.Kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(Device);
+			created.Info.PreferredMultiple = created.Kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(Device);
+			created.Info.LocalMemSize = created.Kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(Device);
+			entry = Entries.insert(make_pair(name, created)).first;
+		}
+		return entry->second;
+	}
+
+public:
+	KernelRegistry(const cl::Program& program, const cl::Device& device) : Program(program), Device(device) {}
+
+	const cl::Program& GetProgram() const {
+		return Program;
+	}
+
+	// The device the work group info is for.
+	const cl::Device& GetDevice() const {
+		return Device;
+	}
+
+	// Get the kernel with this name, it keeps whatever arguments it was last given.
+	cl::Kernel& Get(const string& name) {
+		return GetEntry(name).Kernel;
+	}
+
+	const WorkGroupInfo& GetWorkGroupInfo(const string& name) {
+		return GetEntry(name).Info;
+	}
+
+	// The largest power of two work group the kernel supports, for kernels that halve the work group as they reduce.
+	size_t GetPowerOfTwoLocalSize(const string& name) {
+		const size_t maxLocalSize = GetWorkGroupInfo(name).MaxSize;
+		size_t localSize = 1;
+		while (localSize * 2 <= maxLocalSize) {
+			localSize *= 2;
+		}
+		return localSize;
+	}
+
+	// The largest work group the kernel supports that is still a multiple of the preferred size, so no group ends in a partly used warp or wavefront.
+	size_t GetLargestLocalSize(const string& name) {
+		const WorkGroupInfo& info = GetWorkGroupInfo(name);
+		if (info.PreferredMultiple == 0 || info.PreferredMultiple > info.MaxSize) {
+			return info.MaxSize;
+		}
+		return (info.MaxSize / info.PreferredMultiple) * info.PreferredMultiple;
+	}
+};
\ No newline at end of file
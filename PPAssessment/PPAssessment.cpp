@@ -1,5 +1,8 @@
 #include <iostream>
 #include <vector>
+#include <map>
+#include <numeric>
+#include <climits>
 
 #include "Utils.h"
 #include "CImg.h"
@@ -9,10 +12,14 @@ using namespace cimg_library;
 using namespace std;
 using namespace chrono;
 
+#include "KernelSources.h"
+#include "HostMemory.h";
+#include "BufferPool.h";
+#include "KernelRegistry.h";
 #include "SharedParallel.h";
+#include "SerialProcessor.h";
 #include "ParallelHslProcessor.h";
 #include "ParallelProcessor.h";
-#include "SerialProcessor.h";
 
 void print_help() {
 	cout << "Application usage:" << endl;
@@ -20,6 +27,7 @@ void print_help() {
 	cout << "  -p : select platform " << endl;
 	cout << "  -d : select device" << endl;
 	cout << "  -l : list all platforms and devices" << endl;
+	cout << "  -k : load the kernels from the .cl files in this directory instead of the built in ones" << endl;
 	cout << "  -h : print this message" << endl;
 }
 
@@ -35,6 +43,9 @@ int printMenu() {
 	cout << "[2] Run Histogram Equalisation in Parallel." << endl;
 	cout << "[3] Run Histogram Equalisation in Parallel with Colour Preservation." << endl;
 	cout << "[4] Run Comparison Between Serial and Parallel Performance." << endl;
+	cout << "[5] Run Incremental Parallel Histogram Equalisation on a Following Frame." << endl;
+	cout << "[6] Run Histogram Equalisation in Parallel with Overlapped Colour Channels." << endl;
+	cout << "[7] Run Tiled Histogram Equalisation in Parallel, for Images Larger than Device Memory." << endl;
 
 	int selection = 0;
 	// Go until we get a valid selection.
@@ -51,15 +62,12 @@ int printMenu() {
 	return selection;
 }
 
-CImg<unsigned short> getCustomImage() {
+string getCustomImagePath() {
 	cout << "Enter the absolute file path to the custom image: ";
 	string customFilePath;
 	cin >> customFilePath;
 
-	// Read image from file.
-	CImg<unsigned short> inputImage(customFilePath.c_str());
-	
-	return inputImage;
+	return customFilePath;
 }
 
 unsigned int printBinSizeMenu(const unsigned int& maxBinSize) {
@@ -78,7 +86,81 @@ unsigned int printBinSizeMenu(const unsigned int& maxBinSize) {
 	return selection;
 }
 
-CImg<unsigned short> printImageLoadMenu() {
+unsigned int printSampleStrideMenu() {
+	unsigned int selection = 0;
+	// Go until we get a valid selection.
+	do {
+		cout << endl << "Enter a histogram sampling stride, only 1 in this many pixels is counted (1 for every pixel): ";
+		cin >> selection;
+		if (cin.fail() || selection < 1) {
+			cout << endl << "Invalid entry, please enter an available number." << endl;
+			clearInput();
+			selection = 0;
+		}
+	} while (selection < 1);
+
+	return selection;
+}
+
+SharedParallel::ScanAlgorithm printScanAlgorithmMenu() {
+	cout << endl << "Scan Algorithm" << endl;
+
+	cout << "[1] Automatic (single work group for small histograms, Hillis-Steele or Blelloch for large)." << endl;
+	cout << "[2] Hillis-Steele." << endl;
+	cout << "[3] Blelloch." << endl;
+	cout << "[4] Single Pass with Decoupled Look-Back." << endl;
+	cout << "[5] Compare All." << endl;
+
+	int selection = 0;
+	// Go until we get a valid selection.
+	do {
+		cout << "Select a numbered option: ";
+		cin >> selection;
+		if (cin.fail() || selection < 1 || selection > 5) {
+			cout << endl << "Invalid entry, please enter an available number." << endl;
+			clearInput();
+			selection = -1;
+		}
+	} while (selection < 0);
+
+	switch (selection) {
+	case 2:
+		return SharedParallel::SCAN_HILLIS_STEELE;
+	case 3:
+		return SharedParallel::SCAN_BLELLOCH;
+	case 4:
+		return SharedParallel::SCAN_SINGLE_PASS;
+	case 5:
+		return SharedParallel::SCAN_COMPARE;
+	default:
+		return SharedParallel::SCAN_AUTO;
+	}
+}
+
+// Get the dirty tile size by the user's choice. A tile bigger than the image covers it all anyway, so it is clamped to the image's largest side,
+// and the kernels number the pixels of a tile with a uint so its square must fit in one.
+unsigned int printTileSizeMenu(const unsigned int maxTileSize) {
+	unsigned int selection = 0;
+	// Go until we get a valid selection.
+	do {
+		cout << endl << "Enter a dirty tile size in pixels, changes are tracked in squares of this size: ";
+		cin >> selection;
+		if (!cin.fail() && selection > maxTileSize) {
+			selection = maxTileSize;
+			cout << "\tThe tile size has been clamped to the largest side of the image, " << selection << " pixels." << endl;
+		}
+		if (cin.fail() || selection < 1 || static_cast<unsigned long long>(selection) * selection > UINT_MAX) {
+			cout << endl << "Invalid entry, please enter an available number." << endl;
+			clearInput();
+			selection = 0;
+		}
+	} while (selection < 1);
+
+	return selection;
+}
+
+// Get the file of the image to load by the user's choice.
+string printImageLoadMenu() {
 	cout << endl << "Image Loader" << endl;
 
 	cout << "[1] Small Greyscale (test.ppm)." << endl;
@@ -116,16 +198,40 @@ CImg<unsigned short> printImageLoadMenu() {
 		imageFile = "test_colour_16.ppm";
 		break;
 	case 5:
-		return getCustomImage();
+		return getCustomImagePath();
 	default:
 		cout << "Invalid Menu Selection." << endl;
 		return printImageLoadMenu();
 	}
 
-	// Read image from file.
-	CImg<unsigned short> inputImage(imageFile.c_str());
+	return imageFile;
+}
+
+// Check whether an image file says it stores 8-bit pixels, so it can be loaded straight into chars.
+// Only PNM files say so in their header, any other format is loaded as 16-bit and checked once loaded.
+bool isEightBitFile(const string& imageFile) {
+	ifstream file(imageFile, ios::binary);
+	string magic;
+	if (!(file >> magic) || magic.size() != 2 || magic[0] != 'P' || magic[1] < '1' || magic[1] > '6') {
+		return false;
+	}
+	// Bitmaps only hold 0 or 1.
+	if (magic[1] == '1' || magic[1] == '4') {
+		return true;
+	}
 
-	return inputImage;
+	// The header goes on with the width, height and maximum value, comments run from # to the end of the line.
+	unsigned int header[3];
+	for (unsigned int i = 0; i < 3; i++) {
+		while ((file >> ws).peek() == '#') {
+			string comment;
+			getline(file, comment);
+		}
+		if (!(file >> header[i])) {
+			return false;
+		}
+	}
+	return header[2] <= 255;
 }
 
 // Wait for the CImgDisplays to be closed.
@@ -136,6 +242,130 @@ void waitForImageClosure(CImgDisplay& input, CImgDisplay& output) {
 	}
 }
 
+// Display the input and output images and wait for them to be closed.
+template <typename PixelType>
+void displayImages(const CImg<PixelType>& input, const CImg<PixelType>& output) {
+	CImgDisplay displayInput(input, "input");
+	CImgDisplay displayOutput(output, "output");
+	waitForImageClosure(displayInput, displayOutput);
+}
+
+// Print how the buffer pools have been used, including the pools of any channel lanes.
+void printBufferPoolStatistics(const BufferPool& bufferPool, const vector<SharedParallel::QueueLane>& channelLanes) {
+	cout << "Buffer pool: " << bufferPool.GetStatistics() << endl;
+	for (size_t i = 0; i < channelLanes.size(); i++) {
+		cout << "Channel " << i << " buffer pool: " << channelLanes[i].Pool.GetStatistics() << endl;
+	}
+}
+
+// Get the build options for a program with the given count and pixel types, on top of the device's own options.
+string getKernelOptions(const string& deviceOptions, const bool use64BitCounts, const bool use8BitPixels) {
+	string options = deviceOptions;
+	if (use64BitCounts) {
+		options += options.empty() ? "-D COUNT_64" : " -D COUNT_64";
+	}
+	if (use8BitPixels) {
+		options += options.empty() ? "-D PIXEL_8" : " -D PIXEL_8";
+	}
+	return options;
+}
+
+// Get the kernels of the program built with the given options, building it the first time it is needed and keeping it and its kernels for later images.
+// A binary saved by an earlier run is used instead of building from source when one matches.
+KernelRegistry& getKernels(map<string, KernelRegistry>& programs, const cl::Context& context, const cl::Device& device, const cl::Program::Sources& sources, const string& options) {
+	map<string, KernelRegistry>::iterator program = programs.find(options);
+	if (program == programs.end()) {
+		cout << "Preparing kernels" << (options.empty() ? "" : " with " + options) << "..." << endl;
+		high_resolution_clock::time_point start = high_resolution_clock::now();
+		bool loadedFromCache = false;
+		cl::Program built = BuildProgramCached(context, sources, options, loadedFromCache);
+		cout << "\t" << (loadedFromCache ? "Warm start, loaded the cached binary" : "Cold start, built from source") << " in " << duration<double, milli>(high_resolution_clock::now() - start).count() << "ms" << endl;
+		program = programs.insert(make_pair(options, KernelRegistry(built, device))).first;
+	}
+	return program->second;
+}
+
+// Run the selected RGB algorithm with the given pixel and count types, the program must have been built with the matching types.
+template <typename PixelType, typename CountType>
+CImg<PixelType> runSelection(int selection, KernelRegistry& kernels, BufferPool& bufferPool, cl::CommandQueue& queue, vector<SharedParallel::QueueLane>& channelLanes, CImg<PixelType>& inputImage, unsigned int& binSize, double& totalDuration, size_t& imageSize, unsigned short& maxPixelValue, int& deviceId, const unsigned int sampleStride, const SharedParallel::ScanAlgorithm scanAlgorithm, const SharedParallel::DispatchModel* dispatchModel) {
+	CImg<PixelType> outputImage;
+	switch (selection) {
+	case 1: {
+		SerialProcessor<PixelType, CountType> serialProc(inputImage, binSize, totalDuration, maxPixelValue, imageSize, sampleStride);
+		outputImage = serialProc.RunHistogramEqualisation();
+		break;
+	}
+	case 2: {
+		ParallelProcessor<PixelType, CountType> parallelProc(kernels, bufferPool, queue, inputImage, binSize, totalDuration, imageSize, maxPixelValue, deviceId, sampleStride, scanAlgorithm, dispatchModel);
+		outputImage = parallelProc.RunHistogramEqualisation();
+		break;
+	}
+	case 4: {
+		double totalParallelDuration = 0;
+		SerialProcessor<PixelType, CountType> serialProc(inputImage, binSize, totalDuration, maxPixelValue, imageSize, sampleStride);
+		CImg<PixelType> serialOutput = serialProc.RunHistogramEqualisation();
+
+		ParallelProcessor<PixelType, CountType> parallelProc(kernels, bufferPool, queue, inputImage, binSize, totalParallelDuration, imageSize, maxPixelValue, deviceId, sampleStride, scanAlgorithm, dispatchModel);
+		outputImage = parallelProc.RunHistogramEqualisation();
+
+		cout << endl << "------------------------------------------------------------------------------------------------------" << endl;
+		cout << "\tSerial duration: " << totalDuration << "ms" << endl;
+		cout << "\tParallel duration: " << totalParallelDuration << "ms" << endl;
+		cout << "\tThe parallel implementation is " << static_cast<int>(totalDuration / totalParallelDuration) << " times faster than the serial equivalent on this image." << endl;
+		cout << "------------------------------------------------------------------------------------------------------" << endl;
+		break;
+	}
+	case 5: {
+		const unsigned int tileSize = printTileSizeMenu(max(inputImage.width(), inputImage.height()));
+
+		// Equalise the loaded image in full as the first frame, keeping its histograms.
+		ParallelProcessor<PixelType, CountType> firstFrameProc(kernels, bufferPool, queue, inputImage, binSize, totalDuration, imageSize, maxPixelValue, deviceId, 1, scanAlgorithm, dispatchModel);
+		firstFrameProc.RunHistogramEqualisation();
+		vector<CountType> histogram = firstFrameProc.GetHistogram();
+
+		// Make a following frame that only differs in its top left corner, as a fixed camera would see.
+		// It must be a copy of its own, copying an image that shares zero-copy memory would share it too.
+		CImg<PixelType> nextImage(inputImage, false);
+		cimg_forXYC(nextImage, x, y, c) {
+			if (x < nextImage.width() / 8 && y < nextImage.height() / 8) {
+				nextImage(x, y, 0, c) = static_cast<PixelType>(maxPixelValue - nextImage(x, y, 0, c));
+			}
+		}
+
+		const vector<unsigned int> dirtyTiles = ParallelProcessor<PixelType, CountType>::FindDirtyTiles(inputImage, nextImage, tileSize);
+
+		double incrementalDuration = 0;
+		ParallelProcessor<PixelType, CountType> nextFrameProc(kernels, bufferPool, queue, nextImage, binSize, incrementalDuration, imageSize, maxPixelValue, deviceId, 1, scanAlgorithm, dispatchModel);
+		outputImage = nextFrameProc.RunIncrementalHistogramEqualisation(inputImage, histogram, dirtyTiles, tileSize);
+
+		cout << endl << "------------------------------------------------------------------------------------------------------" << endl;
+		cout << "\t" << dirtyTiles.size() << " of " << ((nextImage.width() + tileSize - 1) / tileSize) * ((nextImage.height() + tileSize - 1) / tileSize) << " tiles changed." << endl;
+		cout << "\tFull duration: " << totalDuration << "ms" << endl;
+		cout << "\tIncremental duration: " << incrementalDuration << "ms" << endl;
+		cout << "------------------------------------------------------------------------------------------------------" << endl;
+
+		// Show the frame that was equalised incrementally.
+		inputImage = nextImage;
+		break;
+	}
+	case 6: {
+		ParallelProcessor<PixelType, CountType> parallelProc(kernels, bufferPool, queue, inputImage, binSize, totalDuration, imageSize, maxPixelValue, deviceId, sampleStride, scanAlgorithm, dispatchModel);
+		outputImage = parallelProc.RunHistogramEqualisationPerChannel(channelLanes);
+		break;
+	}
+	case 7: {
+		ParallelProcessor<PixelType, CountType> parallelProc(kernels, bufferPool, queue, inputImage, binSize, totalDuration, imageSize, maxPixelValue, deviceId, sampleStride, scanAlgorithm, dispatchModel);
+		outputImage = parallelProc.RunTiledHistogramEqualisation();
+		break;
+	}
+	default:
+		cout << "Invalid menu selection." << endl;
+		selection = printMenu();
+	}
+
+	return outputImage;
+}
+
 /*
 Report:
 
@@ -175,10 +405,13 @@ int main(int argc, char** argv) {
 	int deviceId = 0;
 	unsigned int binSize = 1;
 	unsigned short maxPixelValue = 65535;
+	// Empty uses the kernels built into the program.
+	string kernelDirectory;
 
 	for (int i = 1; i < argc; i++) {
 		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platformId = atoi(argv[++i]); }
 		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { deviceId = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-k") == 0) && (i < (argc - 1))) { kernelDirectory = argv[++i]; }
 		else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
 		else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
 	}
@@ -186,6 +419,7 @@ int main(int argc, char** argv) {
 	cimg::exception_mode(0);
 
 	try {
+		high_resolution_clock::time_point startupStart = high_resolution_clock::now();
 
 		// Get OpenCL context for the selected platform and device.
 		cl::Context context = GetContext(platformId, deviceId);
@@ -196,45 +430,80 @@ int main(int argc, char** argv) {
 		// Create a queue to which we will push commands for the device
 		cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
 
+		// Device buffers are reused between kernels, images and modes for as long as the program runs rather than allocated every time.
+		BufferPool bufferPool(context);
+
+		// Extra queues for running colour channels alongside each other, made the first time they are needed.
+		vector<SharedParallel::QueueLane> channelLanes;
+
 		// Load & build the device code.
 		cl::Program::Sources sources;
 
-		// Load the kernels source.
-		AddSources(sources, "RgbKernels.cl");
-		AddSources(sources, "HslKernels.cl");
-		AddSources(sources, "SharedKernels.cl");
-
-		cl::Program program(context, sources);
+		// The kernel sources are compiled into the program, so it runs from any directory. The shared kernels go first because they define the count type used by the others.
+		// With -k they are read from that directory instead, so kernels can be changed without rebuilding.
+		for (size_t i = 0; i < EmbeddedKernelCount; i++) {
+			if (kernelDirectory.empty()) {
+				sources.push_back(EmbeddedKernelSources[i]);
+			}
+			else {
+				AddSources(sources, kernelDirectory + "/" + EmbeddedKernelNames[i]);
+			}
+		}
 
-		// Build and debug the kernel code
-		try {
-			program.build();
+		// Build for the newest OpenCL C the device supports, the kernels use its built-ins where they can and fall back to 1.2 code otherwise.
+		const cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		// Every program on this device is built with its language options, and interleaves the coarsened kernels' reads unless it is a CPU.
+		string deviceOptions = GetLanguageBuildOptions(device);
+		if (!SharedParallel::UsesContiguousStrips(device)) {
+			deviceOptions += deviceOptions.empty() ? "-D INTERLEAVED_STRIPS" : " -D INTERLEAVED_STRIPS";
 		}
-		catch (const cl::Error & err) {
-			std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			throw err;
+		cout << "Device supports " << device.getInfo<CL_DEVICE_OPENCL_C_VERSION>() << (HasSubGroups(device) ? " with sub-groups" : "") << endl;
+
+		// Devices that share memory with the host, such as CPU runtimes, use images in place instead of having them copied to and from the device.
+		const bool zeroCopy = device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() == CL_TRUE;
+		if (zeroCopy) {
+			cout << "Device shares memory with the host, images are used in place without copying" << endl;
 		}
 
-		while (true) {
+		// Programs are built for each combination of count and pixel type the first time an image needs it.
+		// Build the normal program with 32-bit counts and 16-bit pixels up front so any build errors show straight away.
+		map<string, KernelRegistry> programs;
+		KernelRegistry& defaultKernels = getKernels(programs, context, device, sources, getKernelOptions(deviceOptions, false, false));
 
+		// Work out when the histogram scan is cheaper on the host than the device, this is only measured the first time the device is used.
+		const SharedParallel::DispatchModel dispatchModel = SharedParallel::LoadDispatchModel(defaultKernels, bufferPool, queue, "dispatch_costs.txt");
 
-			// Get an image loaded by the user's choice.
-			CImg<unsigned short> inputImage = printImageLoadMenu();
+		cout << "Startup took " << duration<double, milli>(high_resolution_clock::now() - startupStart).count() << "ms" << endl;
 
-			// Get the size of a single channel of the image. i.e. the actual number of pixels.
-			unsigned int imageSize = inputImage.height() * inputImage.width();
+		while (true) {
 
-			// Check if it's 8-bit or 16-bit.
-			maxPixelValue = inputImage.max();
-			if (maxPixelValue > 255) {
-				maxPixelValue = 65535;
+
+			// Get an image loaded by the user's choice. 8-bit files are loaded straight into chars so the image is never held at twice the size.
+			const string imageFile = printImageLoadMenu();
+			CImg<unsigned short> inputImage;
+			CImg<unsigned char> input8Bit;
+			if (isEightBitFile(imageFile)) {
+				input8Bit.load(imageFile.c_str());
 			}
 			else {
-				maxPixelValue = 255;
+				inputImage.load(imageFile.c_str());
+				// Other formats don't say how deep they are, an image with no value above 255 is treated as 8-bit.
+				if (inputImage.max() <= 255) {
+					input8Bit = inputImage;
+					inputImage.assign();
+				}
 			}
 
+			// Check if it's 8-bit or 16-bit.
+			maxPixelValue = input8Bit.is_empty() ? 65535 : 255;
+
+			// Get the size of a single channel of the image. i.e. the actual number of pixels.
+			size_t imageSize = maxPixelValue == 255 ? static_cast<size_t>(input8Bit.height()) * input8Bit.width() : static_cast<size_t>(inputImage.height()) * inputImage.width();
+
+			// 32-bit counts overflow on gigapixel images, so only pay for 64-bit counts when the number of pixels needs them.
+			// All the channels are counted and scanned together so the whole image size is what matters.
+			const bool use64BitCounts = (maxPixelValue == 255 ? input8Bit.size() : inputImage.size()) > numeric_limits<unsigned int>::max();
+
 			int selection = printMenu();
 
 			if (selection == 3) {
@@ -244,60 +513,84 @@ int main(int argc, char** argv) {
 			else {
 				binSize = printBinSizeMenu(maxPixelValue+1);
 			}
-			
-			double totalDuration = 0;
-			CImg<unsigned short> outputImage;
-			switch (selection) {
-			case 1: {
-				SerialProcessor serialProc(inputImage, binSize, totalDuration, maxPixelValue, imageSize);
-				outputImage = serialProc.RunHistogramEqualisation();
-				break;
+
+			// Large images barely change the lookup table when only a sample of their pixels is counted. The HSL processor always counts every pixel,
+			// as do incremental updates since the changed pixels are counted exactly.
+			unsigned int sampleStride = 1;
+			if (selection != 3 && selection != 5) {
+				sampleStride = printSampleStrideMenu();
 			}
-			case 2: {
-				ParallelProcessor parallelProc(program, context, queue, inputImage, binSize, totalDuration, imageSize, maxPixelValue, deviceId);
-				outputImage = parallelProc.RunHistogramEqualisation();
-				break;
+
+			// Only the parallel options run a scan on the device.
+			SharedParallel::ScanAlgorithm scanAlgorithm = SharedParallel::SCAN_AUTO;
+			if (selection != 1) {
+				scanAlgorithm = printScanAlgorithmMenu();
 			}
-			case 3: {
-				ParallelHslProcessor parallelHslProc(program, context, queue, inputImage, binSize, totalDuration, imageSize, maxPixelValue, deviceId);
-				outputImage = parallelHslProc.RunHistogramEqalisation();
-				break;
+			
+			// The HSL conversions always work from 16-bit storage, so only they convert 8-bit images.
+			if (selection == 3 && maxPixelValue == 255) {
+				inputImage = input8Bit;
+				input8Bit.assign();
 			}
-			case 4: {
-				double totalParallelDuration = 0;
-				SerialProcessor serialProc(inputImage, binSize, totalDuration, maxPixelValue, imageSize);
-				CImg<unsigned short> serialOutput = serialProc.RunHistogramEqualisation();
-
-				ParallelProcessor parallelProc(program, context, queue, inputImage, binSize, totalParallelDuration, imageSize, maxPixelValue, deviceId);
-				outputImage = parallelProc.RunHistogramEqualisation();
-
-				cout << endl << "------------------------------------------------------------------------------------------------------" << endl;
-				cout << "\tSerial duration: " << totalDuration << "ms" << endl;
-				cout << "\tParallel duration: " << totalParallelDuration << "ms" << endl;
-				cout << "\tThe parallel implementation is " << static_cast<int>(totalDuration / totalParallelDuration) << " times faster than the serial equivalent on this image." << endl;
-				cout << "------------------------------------------------------------------------------------------------------" << endl;
-				break;
+
+			// CImg's loaders always allocate memory of their own, so for zero-copy the loaded pixels are copied into page-aligned memory here.
+			HostVector<unsigned short> inputStorage;
+			HostVector<unsigned char> input8BitStorage;
+			if (zeroCopy && !inputImage.is_empty()) {
+				MoveToHostMemory(inputImage, inputStorage);
 			}
-			default:
-				cout << "Invalid menu selection." << endl;
-				selection = printMenu();
+			if (zeroCopy && !input8Bit.is_empty()) {
+				MoveToHostMemory(input8Bit, input8BitStorage);
 			}
 
-			if (maxPixelValue == 255) {
-				// 8-Bit image, convert the CImgs to use chars.
-				CImg<unsigned char> input8Bit = inputImage;
-				CImg<unsigned char> output8Bit = outputImage;
-
-				// Display input image.
-				CImgDisplay displayInput(input8Bit, "input");
-				CImgDisplay displayOutput(output8Bit, "output");
-				waitForImageClosure(displayInput, displayOutput);
+			double totalDuration = 0;
+			if (selection == 3) {
+				KernelRegistry& kernels = getKernels(programs, context, device, sources, getKernelOptions(deviceOptions, use64BitCounts, false));
+				CImg<unsigned short> outputImage;
+				if (use64BitCounts) {
+					ParallelHslProcessor<cl_ulong> parallelHslProc(kernels, bufferPool, queue, inputImage, binSize, totalDuration, imageSize, maxPixelValue, deviceId, scanAlgorithm, &dispatchModel);
+					outputImage = parallelHslProc.RunHistogramEqalisation();
+				}
+				else {
+					ParallelHslProcessor<cl_uint> parallelHslProc(kernels, bufferPool, queue, inputImage, binSize, totalDuration, imageSize, maxPixelValue, deviceId, scanAlgorithm, &dispatchModel);
+					outputImage = parallelHslProc.RunHistogramEqalisation();
+				}
+				printBufferPoolStatistics(bufferPool, channelLanes);
+
+				if (maxPixelValue == 255) {
+					// 8-Bit image, convert the CImgs to use chars.
+					displayImages<unsigned char>(inputImage, outputImage);
+				}
+				else {
+					displayImages(inputImage, outputImage);
+				}
+			}
+			else if (maxPixelValue == 255) {
+				// 8-Bit image, run the whole pipeline on chars so half as many bytes are moved.
+				KernelRegistry& kernels = getKernels(programs, context, device, sources, getKernelOptions(deviceOptions, use64BitCounts, true));
+				CImg<unsigned char> output8Bit;
+				if (use64BitCounts) {
+					output8Bit = runSelection<cl_uchar, cl_ulong>(selection, kernels, bufferPool, queue, channelLanes, input8Bit, binSize, totalDuration, imageSize, maxPixelValue, deviceId, sampleStride, scanAlgorithm, &dispatchModel);
+				}
+				else {
+					output8Bit = runSelection<cl_uchar, cl_uint>(selection, kernels, bufferPool, queue, channelLanes, input8Bit, binSize, totalDuration, imageSize, maxPixelValue, deviceId, sampleStride, scanAlgorithm, &dispatchModel);
+				}
+				printBufferPoolStatistics(bufferPool, channelLanes);
+
+				displayImages(input8Bit, output8Bit);
 			}
 			else {
-				// Just display the 16 bit ones.
-				CImgDisplay displayInput(inputImage, "input");
-				CImgDisplay displayOutput(outputImage, "output");
-				waitForImageClosure(displayInput, displayOutput);
+				KernelRegistry& kernels = getKernels(programs, context, device, sources, getKernelOptions(deviceOptions, use64BitCounts, false));
+				CImg<unsigned short> outputImage;
+				if (use64BitCounts) {
+					outputImage = runSelection<cl_ushort, cl_ulong>(selection, kernels, bufferPool, queue, channelLanes, inputImage, binSize, totalDuration, imageSize, maxPixelValue, deviceId, sampleStride, scanAlgorithm, &dispatchModel);
+				}
+				else {
+					outputImage = runSelection<cl_ushort, cl_uint>(selection, kernels, bufferPool, queue, channelLanes, inputImage, binSize, totalDuration, imageSize, maxPixelValue, deviceId, sampleStride, scanAlgorithm, &dispatchModel);
+				}
+				printBufferPoolStatistics(bufferPool, channelLanes);
+
+				displayImages(inputImage, outputImage);
 			}
 			clearInput();
 		}
@@ -308,6 +601,9 @@ int main(int argc, char** argv) {
 	catch (CImgException & err) {
 		std::cout << "ERROR: " << err.what() << std::endl;
 	}
+	catch (const exception & err) {
+		std::cout << "ERROR: " << err.what() << std::endl;
+	}
 
 	return 0;
 }
\ No newline at end of file
@@ -1,254 +1,278 @@
 #pragma once
 
+// CountType is the type of the histogram counts and must match count_t in the kernels the program was built with,
+// cl_uint normally or cl_ulong for a program built with -D COUNT_64.
+template <typename CountType>
 class ParallelHslProcessor {
 private:
-	cl::Program& Program;
-	cl::Context& Context;
+	KernelRegistry& Kernels;
+	BufferPool& Pool;
 	cl::CommandQueue& Queue;
 	CImg<unsigned short>& InputImage;
 	unsigned int& BinSize;
 	double& TotalDurationMs;
-	unsigned int& ImageSize;
+	size_t& ImageSize;
 	unsigned short& MaxPixelValue;
 	int& DeviceId;
+	// The scan used for the cumulative histograms.
+	SharedParallel::ScanAlgorithm CumulativeSumAlgorithm;
+	// Decides whether the automatic scan runs on the host or the device, nullptr always uses the device.
+	const SharedParallel::DispatchModel* Dispatch;
+	// Every command queued for the current image, each waits on the one before. They are only waited for once the RGB image is read back.
+	SharedParallel::EventList Events;
+
+	// Queue the conversion of pixelCount RGB pixels to HSL. The channels of both images are stored pixelCount apart.
+	void EnqueueRgbToHsl(const cl::Buffer& rgbImageBuffer, const cl::Buffer& hslImageBuffer, const size_t pixelCount, const vector<cl::Event>& waitList, cl::Event& perfEvent) {
+		// Get the kernel to use.
+		cl::Kernel& conversionKernel = Kernels.Get("RgbToHsl");
+		// Set kernel arguments.
+		conversionKernel.setArg(0, rgbImageBuffer);
+		conversionKernel.setArg(1, hslImageBuffer);
+		conversionKernel.setArg(2, MaxPixelValue);
+		conversionKernel.setArg(3, static_cast<CountType>(pixelCount));
 
+		// Queue the kernel for execution on the device.
+		Queue.enqueueNDRangeKernel(conversionKernel, cl::NullRange, cl::NDRange(pixelCount), cl::NullRange, &waitList, &perfEvent);
+	}
 
-	vector<float> ConvertRgbToHsl() {
-		const unsigned int sizeOfImage = InputImage.size() * sizeof(unsigned short);
-		const unsigned int sizeOfOutput = InputImage.size() * sizeof(float);
-
-		// Create buffers for the device.
-		cl::Buffer inputImageBuffer(Context, CL_MEM_READ_ONLY, sizeOfImage);
-		cl::Buffer outputImageBuffer(Context, CL_MEM_READ_WRITE, sizeOfOutput);
-
-		// Copy image data to image buffer on the device and wait for it to finish before continuing.
-		Queue.enqueueWriteBuffer(inputImageBuffer, CL_TRUE, 0, sizeOfImage, &InputImage.data()[0]);
-
-		// Create the kernel to use.
-		cl::Kernel conversionKernel = cl::Kernel(Program, "RgbToHsl");
+	// Queue the conversion of pixelCount HSL pixels back to RGB. The channels of both images are stored pixelCount apart.
+	void EnqueueHslToRgb(const cl::Buffer& hslImageBuffer, const cl::Buffer& rgbImageBuffer, const size_t pixelCount, const vector<cl::Event>& waitList, cl::Event& perfEvent) {
+		// Get the kernel to use.
+		cl::Kernel& conversionKernel = Kernels.Get("HslToRgb");
 		// Set kernel arguments.
-		conversionKernel.setArg(0, inputImageBuffer);
-		conversionKernel.setArg(1, outputImageBuffer);
+		conversionKernel.setArg(0, hslImageBuffer);
+		conversionKernel.setArg(1, rgbImageBuffer);
 		conversionKernel.setArg(2, MaxPixelValue);
-		conversionKernel.setArg(3, ImageSize);
+		conversionKernel.setArg(3, static_cast<CountType>(pixelCount));
 
-		// Create  an event for performance tracking.
-		cl::Event perfEvent;
 		// Queue the kernel for execution on the device.
-		Queue.enqueueNDRangeKernel(conversionKernel, cl::NullRange, cl::NDRange(ImageSize), cl::NullRange, NULL, &perfEvent);
+		Queue.enqueueNDRangeKernel(conversionKernel, cl::NullRange, cl::NDRange(pixelCount), cl::NullRange, &waitList, &perfEvent);
+	}
 
-		vector<float> outputData(InputImage.size());
-		// Copy the result from the device to the host.
-		Queue.enqueueReadBuffer(outputImageBuffer, CL_TRUE, 0, sizeOfOutput, &outputData.data()[0]);
+	// Queue counting the luminance of pixelCount HSL pixels into the histogram, adding to what is already there.
+	void EnqueueHistogramHsl(const cl::Buffer& hslImageBuffer, const cl::Buffer& histogramBuffer, const size_t pixelCount, const vector<cl::Event>& waitList, cl::Event& perfEvent) {
+		// Get the kernel to use.
+		cl::Kernel& histogramKernel = Kernels.Get("histogramAtomicHsl");
+		// Set kernel arguments.
+		histogramKernel.setArg(0, hslImageBuffer);
+		histogramKernel.setArg(1, histogramBuffer);
+		histogramKernel.setArg(2, BinSize);
 
-		TotalDurationMs += GetProfilingTotalTimeMs(perfEvent);
+		// Queue the kernel for execution on the device. Only run through one channel - the luminance channel, which is the third plane of the image.
+		Queue.enqueueNDRangeKernel(histogramKernel, cl::NDRange(pixelCount * 2), cl::NDRange(pixelCount), cl::NullRange, &waitList, &perfEvent);
+	}
 
-		// Print out the performance values.
-		cout << "\tConvert RGB to HSL: " << GetFullProfilingInfo(perfEvent, ProfilingResolution::PROF_US) << endl;
+	// Queue backprojecting the luminance of pixelCount HSL pixels in place, hue and saturation are left as they are.
+	void EnqueueBackprojectionHsl(const cl::Buffer& hslImageBuffer, const cl::Buffer& lutBuffer, const size_t pixelCount, const vector<cl::Event>& waitList, cl::Event& perfEvent) {
+		// Get the kernel
+		cl::Kernel& backPropKernel = Kernels.Get("backprojectionHsl");
 
-		return outputData;
-	}
+		// Set the kernel arguments.
+		backPropKernel.setArg(0, hslImageBuffer);
+		backPropKernel.setArg(1, lutBuffer);
+		backPropKernel.setArg(2, BinSize);
 
-	vector<unsigned short> ConvertHslToRgb(const vector<float>& inputImage) {
-		const unsigned int sizeOfImage = inputImage.size() * sizeof(float);
-		const unsigned int sizeOfOutput = inputImage.size() * sizeof(unsigned short);
+		// Execute the kernel on the device, over the luminance plane only.
+		Queue.enqueueNDRangeKernel(backPropKernel, cl::NDRange(pixelCount * 2), cl::NDRange(pixelCount), cl::NullRange, &waitList, &perfEvent);
+	}
 
-		// Create buffers for the device.
-		cl::Buffer inputImageBuffer(Context, CL_MEM_READ_ONLY, sizeOfImage);
-		cl::Buffer outputImageBuffer(Context, CL_MEM_READ_WRITE, sizeOfOutput);
+	// Queue a copy of rows of every channel of the RGB image to or from a band buffer, without blocking.
+	void EnqueueBandCopy(const cl::CommandQueue& queue, const bool toDevice, const cl::Buffer& bandBuffer, unsigned short* image, const size_t firstRow, const size_t rows, const vector<cl::Event>& waitList, cl::Event& event) {
+		SharedParallel::EnqueueBandCopy(queue, toDevice, bandBuffer, image, InputImage.width() * sizeof(unsigned short), ImageSize * sizeof(unsigned short), InputImage.spectrum(), firstRow, rows, waitList, event);
+	}
 
-		// Copy image data to image buffer on the device and wait for it to finish before continuing.
-		Queue.enqueueWriteBuffer(inputImageBuffer, CL_TRUE, 0, sizeOfImage, &inputImage.data()[0]);
+	// Convert the RGB image on the device to HSL, leaving the result on the device.
+	PooledBuffer ConvertRgbToHsl(const cl::Buffer& inputImageBuffer) {
+		const size_t sizeOfOutput = InputImage.size() * sizeof(float);
 
-		// Create the kernel to use.
-		cl::Kernel conversionKernel = cl::Kernel(Program, "HslToRgb");
-		// Set kernel arguments.
-		conversionKernel.setArg(0, inputImageBuffer);
-		conversionKernel.setArg(1, outputImageBuffer);
-		conversionKernel.setArg(2, MaxPixelValue);
-		conversionKernel.setArg(3, ImageSize);
+		// Borrow a buffer for the HSL image.
+		PooledBuffer outputImageBuffer = Pool.Acquire(sizeOfOutput);
 
 		// Create  an event for performance tracking.
 		cl::Event perfEvent;
-		// Queue the kernel for execution on the device.
-		Queue.enqueueNDRangeKernel(conversionKernel, cl::NullRange, cl::NDRange(ImageSize), cl::NullRange, NULL, &perfEvent);
+		EnqueueRgbToHsl(inputImageBuffer, outputImageBuffer, ImageSize, SharedParallel::After(Events), perfEvent);
+		Events.push_back(make_pair(string("Convert RGB to HSL"), perfEvent));
 
-		vector<unsigned short> outputData(inputImage.size());
-		// Copy the result from the device to the host.
-		Queue.enqueueReadBuffer(outputImageBuffer, CL_TRUE, 0, sizeOfOutput, &outputData.data()[0]);
+		return outputImageBuffer;
+	}
+
+	// Convert the HSL image on the device back to RGB and copy it to the host, this is the only copy back of the pipeline.
+	// On devices that share memory with the host the kernel writes straight into the page-aligned output instead.
+	HostVector<unsigned short> ConvertHslToRgb(const cl::Buffer& inputImageBuffer) {
+		const size_t sizeOfOutput = InputImage.size() * sizeof(unsigned short);
+		HostVector<unsigned short> outputData(InputImage.size());
 
-		TotalDurationMs += GetProfilingTotalTimeMs(perfEvent);
+		// Borrow a buffer for the RGB image.
+		const bool outputInPlace = CanUseInPlace(Kernels.GetDevice(), outputData.data());
+		const PooledBuffer outputImageBuffer = outputInPlace ? Pool.WrapHostMemory(outputData.data(), sizeOfOutput, CL_MEM_WRITE_ONLY) : Pool.Acquire(sizeOfOutput);
 
-		// Print out the performance values.
-		cout << "\tConvert HSL to RGB: " << GetFullProfilingInfo(perfEvent, ProfilingResolution::PROF_US) << endl;
+		// Create  an event for performance tracking.
+		cl::Event perfEvent;
+		EnqueueHslToRgb(inputImageBuffer, outputImageBuffer, ImageSize, SharedParallel::After(Events), perfEvent);
+		Events.push_back(make_pair(string("Convert HSL to RGB"), perfEvent));
+
+		if (outputInPlace) {
+			// Mapping the output makes sure the host sees what the kernel wrote, which costs nothing when the memory is shared.
+			const vector<cl::Event> mapWaitList = SharedParallel::After(Events);
+			cl::Event mapEvent;
+			void* mappedOutput = Queue.enqueueMapBuffer(outputImageBuffer, CL_FALSE, CL_MAP_READ, 0, sizeOfOutput, &mapWaitList, &mapEvent);
+			Events.push_back(make_pair(string("Map Output Image"), mapEvent));
+
+			const vector<cl::Event> unmapWaitList = SharedParallel::After(Events);
+			cl::Event unmapEvent;
+			Queue.enqueueUnmapMemObject(outputImageBuffer, mappedOutput, &unmapWaitList, &unmapEvent);
+			Events.push_back(make_pair(string("Unmap Output Image"), unmapEvent));
+		}
+		else {
+			// Copy the result from the device to the host.
+			const vector<cl::Event> readWaitList = SharedParallel::After(Events);
+			cl::Event readEvent;
+			Queue.enqueueReadBuffer(outputImageBuffer, CL_FALSE, 0, sizeOfOutput, &outputData.data()[0], &readWaitList, &readEvent);
+			Events.push_back(make_pair(string("Read Output Image"), readEvent));
+		}
+
+		// This is the one place the image waits for the device, then print out the performance values of every command queued for the image.
+		SharedParallel::ReportEvents(Events, TotalDurationMs);
 
 		return outputData;
 	}
 
-	vector<unsigned int> BuildImageHistogramHsl(const vector<float>& inputImage, size_t& sizeOfHistogram) {
-		// Calculate the number of bins needed.
-		const unsigned int numberOfBins = ceil(100 / static_cast<float>(BinSize));
-
-		// Initialise a vector for the histogram with the appropriate bin size. Add one because this is capacity not maximum index.
-		vector<unsigned int> hist(numberOfBins);
-
+	// Build the histogram of the luminance plane of the HSL image on the device, the histogram stays on the device.
+	PooledBuffer BuildImageHistogramHsl(const cl::Buffer& hslImageBuffer, const unsigned int& numberOfBins) {
 		// Calculate the size of the histogram in bytes - used for buffer allocation.
-		sizeOfHistogram = hist.size() * sizeof(unsigned int);
-		const unsigned int sizeOfImage = ImageSize * sizeof(float);
-
-		// Create buffers for the device.
-		cl::Buffer inputImageBuffer(Context, CL_MEM_READ_ONLY, sizeOfImage);
-		cl::Buffer histogramBuffer(Context, CL_MEM_READ_WRITE, sizeOfHistogram);
+		const size_t sizeOfHistogram = numberOfBins * sizeof(CountType);
 
-		// Copy image data for the luminance channel to image buffer on the device and wait for it to finish before continuing.
-		Queue.enqueueWriteBuffer(inputImageBuffer, CL_TRUE, 0, sizeOfImage, &inputImage.data()[(ImageSize * 2) - 1]);
+		// Borrow a buffer for the histogram.
+		PooledBuffer histogramBuffer = Pool.Acquire(sizeOfHistogram);
 
-		// Create the kernel to use.
-		cl::Kernel histogramKernel = cl::Kernel(Program, "histogramAtomicHsl");
-		// Set kernel arguments.
-		histogramKernel.setArg(0, inputImageBuffer);
-		histogramKernel.setArg(1, histogramBuffer);
-		histogramKernel.setArg(2, BinSize);
+		// The kernel accumulates into the histogram so it must start at zero.
+		const vector<cl::Event> fillWaitList = SharedParallel::After(Events);
+		cl::Event fillEvent;
+		Queue.enqueueFillBuffer(histogramBuffer, static_cast<CountType>(0), 0, sizeOfHistogram, &fillWaitList, &fillEvent);
+		Events.push_back(make_pair(string("Clear Histogram"), fillEvent));
 
 		// Create  an event for performance tracking.
 		cl::Event perfEvent;
-		// Queue the kernel for execution on the device. Only run through one channel - the luminance channel.
-		Queue.enqueueNDRangeKernel(histogramKernel, 0, cl::NDRange(ImageSize), cl::NullRange, NULL, &perfEvent);
-
-		// Copy the result from the device to the host.
-		Queue.enqueueReadBuffer(histogramBuffer, CL_TRUE, 0, sizeOfHistogram, &hist.data()[0]);
+		EnqueueHistogramHsl(hslImageBuffer, histogramBuffer, ImageSize, SharedParallel::After(Events), perfEvent);
+		Events.push_back(make_pair(string("Build Histogram"), perfEvent));
 
-		TotalDurationMs += GetProfilingTotalTimeMs(perfEvent);
-
-		// Print out the performance values.
-		cout << "\tBuild Histogram: " << GetFullProfilingInfo(perfEvent, ProfilingResolution::PROF_US) << endl;
-
-		return hist;
+		return histogramBuffer;
 	}
 
-	vector<float> NormaliseToLookupTableHsl(const size_t& sizeOfHistogram, const vector<unsigned int>& histogram) {
-		const size_t sizeOfOutput = histogram.size() * sizeof(float);
-
-		// Create buffers for the histogram.
-		cl::Buffer histogramInputBuffer(Context, CL_MEM_READ_ONLY, sizeOfHistogram);
-		cl::Buffer histogramOutputBuffer(Context, CL_MEM_READ_WRITE, sizeOfOutput);
-
-		// Get the maximum value from the histogram. Because it is cumulative, it is just the last value.
-		const unsigned int maxHistValue = histogram[histogram.size() - 1];
-
-		// Copy histogram data to device buffer memory.
-		Queue.enqueueWriteBuffer(histogramInputBuffer, CL_TRUE, 0, sizeOfHistogram, &histogram.data()[0]);
+	// Normalise the cumulative histogram on the device to a lookup table of luminance values, the kernel reads the total from the end of the histogram.
+	PooledBuffer NormaliseToLookupTableHsl(const cl::Buffer& histogramInputBuffer, const unsigned int& numberOfBins) {
+		// Borrow a buffer for the lookup table.
+		PooledBuffer histogramOutputBuffer = Pool.Acquire(numberOfBins * sizeof(float));
 
-		// Create the kernel.
-		cl::Kernel lutKernel = cl::Kernel(Program, "normaliseToLutHsl");
+		// Get the kernel.
+		cl::Kernel& lutKernel = Kernels.Get("normaliseToLutHsl");
 
 		// Set the kernel arguments.
 		lutKernel.setArg(0, histogramInputBuffer);
-		lutKernel.setArg(1, maxHistValue);
-		lutKernel.setArg(2, histogramOutputBuffer);
+		lutKernel.setArg(1, histogramOutputBuffer);
 
 		// Create  an event for performance tracking.
+		const vector<cl::Event> waitList = SharedParallel::After(Events);
 		cl::Event perfEvent;
 
 		// Queue the kernel for execution on the device.
-		Queue.enqueueNDRangeKernel(lutKernel, cl::NullRange, cl::NDRange(histogram.size()), cl::NullRange, NULL, &perfEvent);
+		Queue.enqueueNDRangeKernel(lutKernel, cl::NullRange, cl::NDRange(numberOfBins), cl::NullRange, &waitList, &perfEvent);
+		Events.push_back(make_pair(string("Normalise to lookup"), perfEvent));
 
-		vector<float> outputLut(histogram.size());
-		// Copy the result from the output buffer on the device to the host.
-		Queue.enqueueReadBuffer(histogramOutputBuffer, CL_TRUE, 0, sizeOfOutput, &outputLut.data()[0]);
-
-		TotalDurationMs += GetProfilingTotalTimeMs(perfEvent);
-
-		// Print out the performance values.
-		cout << "\tNormalise to lookup: " << GetFullProfilingInfo(perfEvent, ProfilingResolution::PROF_US) << endl;
-
-		return outputLut;
+		return histogramOutputBuffer;
 	}
 
-	vector<float> BackprojectionHsl(const vector<float>& inputImage, const vector<float>& histogram, const unsigned int& binSize, const unsigned int& imageSize, double& totalDurationMs) {
-
-		const unsigned int sizeOfHistogram = sizeof(float) * histogram.size();
-		const unsigned int sizeOfImage = imageSize * sizeof(float);
-
-		// Create buffers to store the data on the device.
-		cl::Buffer inputImageBuffer(Context, CL_MEM_READ_ONLY, sizeOfImage);
-		cl::Buffer inputHistBuffer(Context, CL_MEM_READ_ONLY, sizeOfHistogram);
-		cl::Buffer outputImageBuffer(Context, CL_MEM_READ_WRITE, sizeOfImage);
-
-		// Write the data for the input image and histogram lookup table to the buffers.
-		Queue.enqueueWriteBuffer(inputImageBuffer, CL_TRUE, 0, sizeOfImage, &inputImage.data()[(imageSize * 2) - 1]);
-		Queue.enqueueWriteBuffer(inputHistBuffer, CL_TRUE, 0, sizeOfHistogram, &histogram.data()[0]);
-
-		// Create the kernel
-		cl::Kernel backPropKernel = cl::Kernel(Program, "backprojectionHsl");
-
-		// Set the kernel arguments.
-		backPropKernel.setArg(0, inputImageBuffer);
-		backPropKernel.setArg(1, inputHistBuffer);
-		backPropKernel.setArg(2, outputImageBuffer);
-		backPropKernel.setArg(3, binSize);
-
+	// Backproject the luminance plane of the HSL image in place, hue and saturation are left as they are.
+	void BackprojectionHsl(const cl::Buffer& hslImageBuffer, const cl::Buffer& lutBuffer) {
 		// Create  an event for performance tracking.
 		cl::Event perfEvent;
+		EnqueueBackprojectionHsl(hslImageBuffer, lutBuffer, ImageSize, SharedParallel::After(Events), perfEvent);
+		Events.push_back(make_pair(string("Backprojection"), perfEvent));
+	}
 
-		// Execute the kernel on the device.
-		Queue.enqueueNDRangeKernel(backPropKernel, cl::NullRange, cl::NDRange(imageSize), cl::NullRange, NULL, &perfEvent);
-
-		// Create the vector to store the output data.
-		vector<float> outputData(imageSize);
-
-		// Copy the output from the device buffer to the output vector on the host.
-		Queue.enqueueReadBuffer(outputImageBuffer, CL_TRUE, 0, sizeOfImage, &outputData.data()[0]);
-
-		// Create an output image data with the hue and saturation channels from the input.
-		vector<float>::const_iterator first = inputImage.begin();
-		vector<float>::const_iterator last = inputImage.begin() + (imageSize * 2);
-		vector<float> outputImageData(first, last);
-
-		// Append new luminance channel.
-		outputImageData.insert(outputImageData.end(), outputData.begin(), outputData.end());
-
-		totalDurationMs += GetProfilingTotalTimeMs(perfEvent);
-
-		// Print out the performance values.
-		cout << "\tBackprojection: " << GetFullProfilingInfo(perfEvent, ProfilingResolution::PROF_US) << endl;
-
-		return outputImageData;
+	// Scan the luminance histogram and turn it into a lookup table, which stays on the device.
+	PooledBuffer BuildLookupTableHsl(const cl::Buffer& histogramBuffer, const unsigned int& numberOfBins) {
+		PooledBuffer lutBuffer;
+		if (CumulativeSumAlgorithm == SharedParallel::SCAN_AUTO && Dispatch != nullptr && Dispatch->ScanAndNormalise.PreferHost(numberOfBins)) {
+			// Small histograms are cheaper to copy back, scan and normalise on the host than to launch kernels for.
+			high_resolution_clock::time_point start = high_resolution_clock::now();
+			lutBuffer = Pool.Acquire(numberOfBins * sizeof(float));
+			SharedParallel::ScanAndNormaliseOnHost<CountType, float>(Queue, histogramBuffer, lutBuffer, numberOfBins, 1, 100, Events);
+			const double durationUs = duration<double, micro>(high_resolution_clock::now() - start).count();
+
+			TotalDurationMs += durationUs / 1000;
+			cout << "\tHost Scan and Normalise (cheaper than the device for " << numberOfBins << " bins): " << durationUs << " [us]" << endl;
+		}
+		else {
+			// Cumulative sum the histogram.
+			const PooledBuffer cumulativeHistogramBuffer = Pool.Acquire(numberOfBins * sizeof(CountType));
+			SharedParallel::CumulativeSumBuffer<CountType>(Kernels, Pool, Queue, histogramBuffer, cumulativeHistogramBuffer, numberOfBins, Events, CumulativeSumAlgorithm);
+
+			// Normalise and create a lookup table from the cumulative histogram.
+			lutBuffer = NormaliseToLookupTableHsl(cumulativeHistogramBuffer, numberOfBins);
+		}
+		return lutBuffer;
 	}
 
 public:
-	ParallelHslProcessor(cl::Program& program, cl::Context& context, cl::CommandQueue& queue, CImg<unsigned short>& inputImage, unsigned int& binSize, double& totalDurationMs, unsigned int& imageSize, unsigned short& maxPixelValue, int& deviceId) :
-		Program(program),
-		Context(context),
+	// Kernels come from the registry and device buffers are borrowed from the pool, both must outlive the processor.
+	ParallelHslProcessor(KernelRegistry& kernels, BufferPool& pool, cl::CommandQueue& queue, CImg<unsigned short>& inputImage, unsigned int& binSize, double& totalDurationMs, size_t& imageSize, unsigned short& maxPixelValue, int& deviceId, const SharedParallel::ScanAlgorithm scanAlgorithm = SharedParallel::SCAN_AUTO, const SharedParallel::DispatchModel* dispatchModel = nullptr) :
+		Kernels(kernels),
+		Pool(pool),
 		Queue(queue),
 		InputImage(inputImage),
 		BinSize(binSize),
 		TotalDurationMs(totalDurationMs),
 		ImageSize(imageSize),
 		MaxPixelValue(maxPixelValue),
-		DeviceId(deviceId) {}
+		DeviceId(deviceId),
+		CumulativeSumAlgorithm(scanAlgorithm),
+		Dispatch(dispatchModel) {}
 
 	CImg<unsigned short> RunHistogramEqalisation() {
+		// The RGB input and output and the HSL image, which takes twice the bytes, all have to be on the device at once, each in a single buffer.
+		// Anything bigger is equalised a band at a time.
+		const size_t sizeOfRgbImage = InputImage.size() * sizeof(unsigned short);
+		const size_t sizeOfHslImage = InputImage.size() * sizeof(float);
+		if (!SharedParallel::FitsOnDevice(Kernels.GetDevice(), sizeOfHslImage, 2 * sizeOfRgbImage + sizeOfHslImage)) {
+			cout << endl << "The image is too large for the device to hold its RGB and HSL images at once." << endl;
+			return RunTiledHistogramEqualisation();
+		}
+
 		cout << endl << "Running parallel Histogram Equalisation with colour preservation..." << endl;
 
+		// Calculate the number of bins needed, luminance is a percentage.
+		const unsigned int numberOfBins = ceil(100 / static_cast<float>(BinSize));
+
+		// Copy the image to the device once, everything up to the final RGB image stays there. Devices that share memory with the host use it where it is.
+		// The write doesn't block, every command after it waits on the one before so nothing reads the image early.
+		Events.clear();
+		const size_t sizeOfImage = InputImage.size() * sizeof(unsigned short);
+		PooledBuffer inputImageBuffer;
+		if (CanUseInPlace(Kernels.GetDevice(), InputImage.data())) {
+			inputImageBuffer = Pool.WrapHostMemory(InputImage.data(), sizeOfImage, CL_MEM_READ_ONLY);
+		}
+		else {
+			inputImageBuffer = Pool.Acquire(sizeOfImage);
+			cl::Event writeEvent;
+			Queue.enqueueWriteBuffer(inputImageBuffer, CL_FALSE, 0, sizeOfImage, &InputImage.data()[0], NULL, &writeEvent);
+			Events.push_back(make_pair(string("Write Image"), writeEvent));
+		}
+
 		// Convert the input RGB image to HSL colour space.
-		vector<float> hslImage = ConvertRgbToHsl();
+		const PooledBuffer hslImageBuffer = ConvertRgbToHsl(inputImageBuffer);
 
 		// Build a histogram on the luminance channel.
-		size_t sizeOfHistogram;
-		vector<unsigned int> hist = BuildImageHistogramHsl(hslImage, sizeOfHistogram);
-
-		// Cumulative sum the histogram.
-		hist = SharedParallel::CumulativeSumParallel(Program, Context, Queue, DeviceId, hist, TotalDurationMs);
+		const PooledBuffer histogramBuffer = BuildImageHistogramHsl(hslImageBuffer, numberOfBins);
 
-		// Normalise and create a lookup table from the cumulative histogram.
-		vector<float> hslHist = NormaliseToLookupTableHsl(sizeOfHistogram, hist);
+		// Scan and normalise the histogram to a lookup table.
+		const PooledBuffer lutBuffer = BuildLookupTableHsl(histogramBuffer, numberOfBins);
 
 		// Backproject with the lookup table histogram.
-		vector<float> backProjection = BackprojectionHsl(hslImage, hslHist, BinSize, ImageSize, TotalDurationMs);
+		BackprojectionHsl(hslImageBuffer, lutBuffer);
 
 		// Convert back to RGB.
-		vector<unsigned short> outputData = ConvertHslToRgb(backProjection);
+		HostVector<unsigned short> outputData = ConvertHslToRgb(hslImageBuffer);
 
 		cout << endl << "Total HSL Kernel Duration: " << TotalDurationMs << "ms" << endl;
 
@@ -258,5 +282,117 @@ public:
 		return outputImage;
 	}
 
+	// Equalise an image too big for the device a band of rows at a time. The HSL image is never kept, each band is converted again in the second pass.
+	// The first pass converts the bands to HSL and counts their luminance into one histogram. The second converts them again, backprojects them
+	// with the lookup table from it and converts them back to RGB. Bands are double buffered, with the copies on a second queue, so one band
+	// is copied while the kernels run on another.
+	CImg<unsigned short> RunTiledHistogramEqualisation() {
+		cout << endl << "Running tiled parallel Histogram Equalisation with colour preservation..." << endl;
+
+		// Calculate the number of bins needed, luminance is a percentage.
+		const unsigned int numberOfBins = ceil(100 / static_cast<float>(BinSize));
+		const unsigned int channels = InputImage.spectrum();
+		const size_t width = InputImage.width();
+		const size_t height = InputImage.height();
+
+		// Six band buffers, an RGB input, an HSL band and an RGB output for each of the two bands in flight. The HSL bands are the largest.
+		const size_t rgbRowBytes = width * channels * sizeof(unsigned short);
+		const size_t hslRowBytes = width * channels * sizeof(float);
+		const size_t bandRows = SharedParallel::GetBandRows(Kernels.GetDevice(), height, 4 * rgbRowBytes + 2 * hslRowBytes, hslRowBytes);
+		if (bandRows == 0) {
+			throw runtime_error("The image is " + to_string(width) + " pixels wide, too wide for a single row to fit in this device's memory.");
+		}
+		const size_t numberOfBands = (height + bandRows - 1) / bandRows;
+
+		cout << endl << "Processing " << numberOfBands << " band(s) of up to " << bandRows << " rows" << endl;
+
+		// The copies run on a queue of their own so they can overlap the kernels, events order the commands across the two queues.
+		cl::CommandQueue transferQueue(Pool.GetContext(), Kernels.GetDevice(), CL_QUEUE_PROFILING_ENABLE);
+
+		// Two of each band buffer, so one band can be copied while the other is processed.
+		const PooledBuffer inputBands[2] = { Pool.Acquire(bandRows * rgbRowBytes), Pool.Acquire(bandRows * rgbRowBytes) };
+		const PooledBuffer hslBands[2] = { Pool.Acquire(bandRows * hslRowBytes), Pool.Acquire(bandRows * hslRowBytes) };
+		const PooledBuffer outputBands[2] = { Pool.Acquire(bandRows * rgbRowBytes), Pool.Acquire(bandRows * rgbRowBytes) };
+
+		// Pass 1, count the luminance of every band into one histogram.
+		Events.clear();
+		const size_t sizeOfHistogram = numberOfBins * sizeof(CountType);
+		const PooledBuffer histogramBuffer = Pool.Acquire(sizeOfHistogram);
+		cl::Event fillEvent;
+		Queue.enqueueFillBuffer(histogramBuffer, static_cast<CountType>(0), 0, sizeOfHistogram, NULL, &fillEvent);
+		Events.push_back(make_pair(string("Clear Histogram"), fillEvent));
+
+		vector<cl::Event> uploadEvents(numberOfBands);
+		vector<cl::Event> convertEvents(numberOfBands);
+		for (size_t band = 0; band < numberOfBands; band++) {
+			const size_t firstRow = band * bandRows;
+			const size_t rows = min(bandRows, height - firstRow);
+			const string bandName = "Band " + to_string(band) + " ";
+
+			// A band buffer can be refilled once the band two before it has been converted.
+			const vector<cl::Event> uploadWaitList = band >= 2 ? vector<cl::Event>(1, convertEvents[band - 2]) : vector<cl::Event>();
+			EnqueueBandCopy(transferQueue, true, inputBands[band % 2], InputImage.data(), firstRow, rows, uploadWaitList, uploadEvents[band]);
+			Events.push_back(make_pair(bandName + "Write", uploadEvents[band]));
+
+			// The kernels run one after another on the main queue, after the histogram is cleared.
+			EnqueueRgbToHsl(inputBands[band % 2], hslBands[band % 2], rows * width, vector<cl::Event>(1, uploadEvents[band]), convertEvents[band]);
+			Events.push_back(make_pair(bandName + "Convert RGB to HSL", convertEvents[band]));
+
+			cl::Event countEvent;
+			EnqueueHistogramHsl(hslBands[band % 2], histogramBuffer, rows * width, vector<cl::Event>(), countEvent);
+			Events.push_back(make_pair(bandName + "Build Histogram", countEvent));
+		}
+
+		// The last count is the last of the main queue, so the scan waits for every band.
+		const PooledBuffer lutBuffer = BuildLookupTableHsl(histogramBuffer, numberOfBins);
+		const cl::Event lutEvent = Events.back().second;
+
+		// Pass 2, convert every band again, backproject its luminance and convert it back to RGB straight into the output image.
+		// The next band is copied to the device before this one is copied back, so the copy in overlaps this band's kernels.
+		CImg<unsigned short> outputImage(InputImage.width(), InputImage.height(), InputImage.depth(), channels);
+		vector<cl::Event> downloadEvents(numberOfBands);
+		for (size_t band = 0; band < numberOfBands + 1; band++) {
+			if (band < numberOfBands) {
+				// The input buffers were last read by the first pass, and after that by the band two before.
+				const size_t firstRow = band * bandRows;
+				const vector<cl::Event> uploadWaitList(1, band >= 2 ? convertEvents[band - 2] : lutEvent);
+				EnqueueBandCopy(transferQueue, true, inputBands[band % 2], InputImage.data(), firstRow, min(bandRows, height - firstRow), uploadWaitList, uploadEvents[band]);
+				Events.push_back(make_pair("Band " + to_string(band) + " Write", uploadEvents[band]));
+			}
+
+			if (band == 0) {
+				continue;
+			}
+
+			const size_t current = band - 1;
+			const size_t firstRow = current * bandRows;
+			const size_t rows = min(bandRows, height - firstRow);
+			const string bandName = "Band " + to_string(current) + " ";
+
+			EnqueueRgbToHsl(inputBands[current % 2], hslBands[current % 2], rows * width, vector<cl::Event>(1, uploadEvents[current]), convertEvents[current]);
+			Events.push_back(make_pair(bandName + "Convert RGB to HSL", convertEvents[current]));
+
+			cl::Event backprojectionEvent;
+			EnqueueBackprojectionHsl(hslBands[current % 2], lutBuffer, rows * width, vector<cl::Event>(), backprojectionEvent);
+			Events.push_back(make_pair(bandName + "Backprojection", backprojectionEvent));
+
+			// The output buffer must have been copied back from the band two before.
+			const vector<cl::Event> rgbWaitList = current >= 2 ? vector<cl::Event>(1, downloadEvents[current - 2]) : vector<cl::Event>();
+			cl::Event rgbEvent;
+			EnqueueHslToRgb(hslBands[current % 2], outputBands[current % 2], rows * width, rgbWaitList, rgbEvent);
+			Events.push_back(make_pair(bandName + "Convert HSL to RGB", rgbEvent));
+
+			EnqueueBandCopy(transferQueue, false, outputBands[current % 2], outputImage.data(), firstRow, rows, vector<cl::Event>(1, rgbEvent), downloadEvents[current]);
+			Events.push_back(make_pair(bandName + "Read", downloadEvents[current]));
+		}
+
+		// This is the one place the image waits for the device, both queues must be done before the band buffers go back to the pool.
+		transferQueue.finish();
+		Queue.finish();
+		SharedParallel::ReportEvents(Events, TotalDurationMs);
+
+		cout << endl << "Total HSL Kernel Duration: " << TotalDurationMs << "ms" << endl;
 
+		return outputImage;
+	}
 };
\ No newline at end of file
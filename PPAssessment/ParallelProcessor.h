@@ -1,187 +1,732 @@
 #pragma once
 
+// PixelType is the storage type of the image and must match pixel_t in the kernels the program was built with,
+// cl_ushort normally or cl_uchar for a program built with -D PIXEL_8.
+// CountType is the type of the histogram counts and must match count_t in the kernels the program was built with,
+// cl_uint normally or cl_ulong for a program built with -D COUNT_64.
+template <typename PixelType, typename CountType>
 class ParallelProcessor {
-private: 
-	cl::Program& Program;
-	cl::Context& Context;
+private:
+	KernelRegistry& Kernels;
+	BufferPool& Pool;
 	cl::CommandQueue& Queue;
-	CImg<unsigned short>& InputImage;
+	CImg<PixelType>& InputImage;
 	unsigned int& BinSize;
 	double& TotalDurationMs;
-	unsigned int& ImageSize;
+	size_t& ImageSize;
 	unsigned short& MaxPixelValue;
 	int& DeviceId;
+	// The scan used for the cumulative histograms.
+	SharedParallel::ScanAlgorithm CumulativeSumAlgorithm;
+	// Decides whether the automatic scan and normalisation run on the host or the device, nullptr always uses the device.
+	const SharedParallel::DispatchModel* Dispatch;
+	// Only 1 in SampleStride strips of pixels is counted when building the histogram, 1 counts every pixel.
+	unsigned int SampleStride;
+
+	// The raw histograms of every channel from the last full or incremental run, stored back to back on the device.
+	// They are only copied to the host if GetHistogram is called, and the buffer goes back to the pool when the next run replaces it.
+	PooledBuffer HistogramBuffer;
+	size_t HistogramCount = 0;
+
+	// Every command queued for the current image, each waits on the one before. They are only waited for once the output image is read back.
+	SharedParallel::EventList Events;
+	// The dirty tiles of the previous frame packed for the device, kept here so the write from them doesn't have to block.
+	vector<PixelType> PreviousTiles;
+
+	// The most bins the register-resident histogram kernel can hold, must match MAX_PRIVATE_BINS in RgbKernels.cl.
+	static const unsigned int MaxPrivateBins = 32;
+
+	// Build one histogram per colour channel, stored back to back in a buffer that stays on the device.
+	PooledBuffer BuildImageHistogram(const cl::Buffer& inputImageBuffer, const unsigned int& channels, const unsigned int& numberOfBins) {
+
+		// Calculate the size of the histograms in bytes - used for buffer allocation.
+		const size_t sizeOfHistogram = static_cast<size_t>(numberOfBins) * channels * sizeof(CountType);
+
+		// Borrow a buffer for the histograms on the device.
+		PooledBuffer histogramBuffer = Pool.Acquire(sizeOfHistogram);
+
+		// The kernels accumulate into the histogram so it must start at zero.
+		const vector<cl::Event> fillWaitList = SharedParallel::After(Events);
+		cl::Event fillEvent;
+		Queue.enqueueFillBuffer(histogramBuffer, static_cast<CountType>(0), 0, sizeOfHistogram, &fillWaitList, &fillEvent);
+		Events.push_back(make_pair(string("Clear Histograms"), fillEvent));
+
+		// Count every channel once the histograms are cleared. Nothing waits for the kernel here, its profiling info is printed with the rest of the image's commands.
+		cl::Event perfEvent;
+		const string kernelName = EnqueueHistogramKernel(inputImageBuffer, histogramBuffer, ImageSize, channels, numberOfBins, SharedParallel::After(Events), perfEvent);
+		Events.push_back(make_pair("Build Histogram (" + kernelName + ")", perfEvent));
 
-	vector<unsigned int> BuildImageHistogram(const vector<unsigned short>& imageColourChannelData, const size_t& sizeOfImageChannel, const unsigned char& colourChannel, size_t& sizeOfHistogram) {
+		return histogramBuffer;
+	}
 
-		// Calculate the number of bins needed.
-		const unsigned int numberOfBins = ceil((MaxPixelValue+1) / BinSize);
+	// Get the local memory left for a kernel's local arguments, after anything the kernel keeps in local memory itself.
+	cl_ulong GetAvailableLocalMemory(const string& kernelName) {
+		const cl_ulong localMemory = Kernels.GetDevice().getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+		const cl_ulong kernelLocalMemory = Kernels.GetWorkGroupInfo(kernelName).LocalMemSize;
+		return localMemory > kernelLocalMemory ? localMemory - kernelLocalMemory : 0;
+	}
 
-		// Initialise a vector for the histogram with the appropriate bin size. Add one because this is capacity not maximum index.
-		vector<unsigned int> hist(numberOfBins);
+	// Queue the histogram kernel best suited to the device, adding pixelCount pixels of every channel to the histograms already in histogramBuffer.
+	// The channels are stored pixelCount apart in the image buffer. Returns the name of the kernel used, for the profiling report.
+	string EnqueueHistogramKernel(const cl::Buffer& inputImageBuffer, const cl::Buffer& histogramBuffer, const size_t pixelCount, const unsigned int& channels, const unsigned int& numberOfBins, const vector<cl::Event>& waitList, cl::Event& perfEvent) {
+		// A work group only ever counts a single channel, so this is the size it needs in local memory. Local counts are always 32-bit.
+		const size_t sizeOfChannelHistogram = numberOfBins * sizeof(unsigned int);
+
+		// Get the device so we can extract info about it.
+		const cl::Device& device = Kernels.GetDevice();
+
+		// Work out how many pixels each work item should process on this device, and how many work items that needs per channel.
+		// When sampling, only 1 in SampleStride strips of pixels is counted so fewer work items are needed. With interleaved strips
+		// the same number of work items covers the channel, each reading 1 in SampleStride vectors.
+		const unsigned int pixelsPerItem = SharedParallel::GetPixelsPerWorkItem(device, pixelCount / SampleStride);
+		const size_t strips = (pixelCount + pixelsPerItem - 1) / pixelsPerItem;
+		const size_t workItems = (strips + SampleStride - 1) / SampleStride;
+
+		string kernelName;
+
+		// Very small histograms are counted in registers with no atomics at all.
+		if (numberOfBins <= MaxPrivateBins) {
+			kernelName = "histogramPrivate";
+
+			// Get the kernel to use.
+			cl::Kernel& histogramKernel = Kernels.Get(kernelName);
+
+			// The reduction needs a power of two local size, so use the largest one the kernel supports.
+			const size_t localSize = Kernels.GetPowerOfTwoLocalSize(kernelName);
+			// Round the global size up to a multiple of the local size, the kernel ignores the extra work items.
+			const size_t globalSize = ((workItems + localSize - 1) / localSize) * localSize;
+
+			// Set kernel arguments.
+			histogramKernel.setArg(0, inputImageBuffer);
+			histogramKernel.setArg(1, histogramBuffer);
+			histogramKernel.setArg(2, BinSize);
+			histogramKernel.setArg(3, numberOfBins);
+			histogramKernel.setArg(4, pixelsPerItem);
+			histogramKernel.setArg(5, SampleStride);
+			histogramKernel.setArg(6, static_cast<CountType>(pixelCount));
+			histogramKernel.setArg(7, cl::Local(localSize * sizeof(unsigned int)));
+
+			// Queue the kernel for execution on the device, one row of work groups per colour channel.
+			Queue.enqueueNDRangeKernel(histogramKernel, cl::NullRange, cl::NDRange(globalSize, channels), cl::NDRange(localSize, 1), &waitList, &perfEvent);
+		}
+		// Use the privatised local memory kernel whenever a channel's histogram fits in the local memory the kernel leaves free.
+		else if (sizeOfChannelHistogram <= GetAvailableLocalMemory("histogramLocal")) {
+			kernelName = "histogramLocal";
+
+			// Get the kernel to use.
+			cl::Kernel& histogramKernel = Kernels.Get(kernelName);
+
+			// Use the largest work group the kernel supports so there are as few sub-histograms to merge as possible.
+			const size_t localSize = Kernels.GetLargestLocalSize(kernelName);
+			// Round the global size up to a multiple of the local size, the kernel ignores the extra work items.
+			const size_t globalSize = ((workItems + localSize - 1) / localSize) * localSize;
+
+			// Set kernel arguments.
+			histogramKernel.setArg(0, inputImageBuffer);
+			histogramKernel.setArg(1, histogramBuffer);
+			histogramKernel.setArg(2, BinSize);
+			histogramKernel.setArg(3, numberOfBins);
+			histogramKernel.setArg(4, pixelsPerItem);
+			histogramKernel.setArg(5, SampleStride);
+			histogramKernel.setArg(6, static_cast<CountType>(pixelCount));
+			histogramKernel.setArg(7, cl::Local(sizeOfChannelHistogram));
+
+			// Queue the kernel for execution on the device, one row of work groups per colour channel.
+			Queue.enqueueNDRangeKernel(histogramKernel, cl::NullRange, cl::NDRange(globalSize, channels), cl::NDRange(localSize, 1), &waitList, &perfEvent);
+		}
+		// Otherwise split the bins into slices that do fit in local memory, e.g. for the 65536 bins of a 16-bit image.
+		else if (GetAvailableLocalMemory("histogramPartitioned") >= sizeof(unsigned int)) {
+			kernelName = "histogramPartitioned";
+
+			// Get the kernel to use.
+			cl::Kernel& histogramKernel = Kernels.Get(kernelName);
+
+			// Use as few slices as local memory allows so the image is read as few times as possible, leaving room for anything the kernel itself keeps in local memory.
+			const cl_ulong availableLocalMemory = GetAvailableLocalMemory(kernelName);
+			const unsigned int maxSliceBins = static_cast<unsigned int>(availableLocalMemory / sizeof(unsigned int));
+			const unsigned int numberOfSlices = (numberOfBins + maxSliceBins - 1) / maxSliceBins;
+			// Then share the bins evenly between the slices.
+			const unsigned int sliceBins = (numberOfBins + numberOfSlices - 1) / numberOfSlices;
+
+			// Use the largest work group the kernel supports so there are as few slices to merge as possible.
+			const size_t localSize = Kernels.GetLargestLocalSize(kernelName);
+			// Round the global size up to a multiple of the local size, the kernel ignores the extra work items.
+			const size_t globalSize = ((workItems + localSize - 1) / localSize) * localSize;
+
+			// Set kernel arguments.
+			histogramKernel.setArg(0, inputImageBuffer);
+			histogramKernel.setArg(1, histogramBuffer);
+			histogramKernel.setArg(2, BinSize);
+			histogramKernel.setArg(3, numberOfBins);
+			histogramKernel.setArg(4, sliceBins);
+			histogramKernel.setArg(5, pixelsPerItem);
+			histogramKernel.setArg(6, SampleStride);
+			histogramKernel.setArg(7, static_cast<CountType>(pixelCount));
+			histogramKernel.setArg(8, cl::Local(sliceBins * sizeof(unsigned int)));
+
+			// Queue the kernel for execution on the device, one row of work groups per colour channel and bin slice.
+			Queue.enqueueNDRangeKernel(histogramKernel, cl::NullRange, cl::NDRange(globalSize, channels, numberOfSlices), cl::NDRange(localSize, 1, 1), &waitList, &perfEvent);
+
+			kernelName += ", " + to_string(numberOfSlices) + " slices";
+		}
+		// Devices without any local memory fall back to counting straight into global memory.
+		else {
+			kernelName = "histogramCoarse";
+
+			// Get the kernel to use.
+			cl::Kernel& histogramKernel = Kernels.Get(kernelName);
+			// Set kernel arguments.
+			histogramKernel.setArg(0, inputImageBuffer);
+			histogramKernel.setArg(1, histogramBuffer);
+			histogramKernel.setArg(2, BinSize);
+			histogramKernel.setArg(3, numberOfBins);
+			histogramKernel.setArg(4, pixelsPerItem);
+			histogramKernel.setArg(5, SampleStride);
+			histogramKernel.setArg(6, static_cast<CountType>(pixelCount));
+
+			// Queue the kernel for execution on the device, one row of work items per colour channel.
+			Queue.enqueueNDRangeKernel(histogramKernel, cl::NullRange, cl::NDRange(workItems, channels), cl::NullRange, &waitList, &perfEvent);
+		}
 
-		// Calculate the size of the histogram in bytes - used for buffer allocation.
-		sizeOfHistogram = hist.size() * sizeof(unsigned int);
+		return kernelName;
+	}
 
-		// Create buffers for the device.
-		cl::Buffer inputImageBuffer(Context, CL_MEM_READ_ONLY, sizeOfImageChannel);
-		cl::Buffer histogramBuffer(Context, CL_MEM_READ_WRITE, sizeOfHistogram);
+	// Update the previous frame's histograms for the current image on the device, only the dirty tiles of both frames are read.
+	PooledBuffer UpdateImageHistogram(const cl::Buffer& inputImageBuffer, const CImg<PixelType>& previousImage, const vector<CountType>& hist, const vector<unsigned int>& dirtyTiles, const unsigned int& tileSize, const unsigned int& channels, const unsigned int& numberOfBins) {
+		const size_t sizeOfHistogram = hist.size() * sizeof(CountType);
+		const unsigned int width = InputImage.width();
+		const unsigned int height = InputImage.height();
+		const unsigned int tilesPerRow = (width + tileSize - 1) / tileSize;
+		const size_t tilePixels = static_cast<size_t>(tileSize) * tileSize;
+
+		// Pack the dirty tiles of the previous frame together so only they are sent to the device, rather than the whole frame.
+		PreviousTiles.assign(dirtyTiles.size() * channels * tilePixels, 0);
+		for (size_t d = 0; d < dirtyTiles.size(); d++) {
+			const unsigned int tileX = (dirtyTiles[d] % tilesPerRow) * tileSize;
+			const unsigned int tileY = (dirtyTiles[d] / tilesPerRow) * tileSize;
+			// Tiles on the right and bottom edges may be cut short by the image.
+			const unsigned int rowLength = min(tileSize, width - tileX);
+			for (unsigned int c = 0; c < channels; c++) {
+				for (unsigned int row = 0; row < tileSize && tileY + row < height; row++) {
+					const PixelType* source = previousImage.data(tileX, tileY + row, 0, c);
+					copy(source, source + rowLength, PreviousTiles.begin() + ((d * channels + c) * tilePixels + row * tileSize));
+				}
+			}
+		}
 
-		// Copy image data to image buffer on the device and wait for it to finish before continuing.
-		Queue.enqueueWriteBuffer(inputImageBuffer, CL_TRUE, 0, sizeOfImageChannel, &imageColourChannelData.data()[0]);
+		const size_t sizeOfTiles = PreviousTiles.size() * sizeof(PixelType);
+		const size_t sizeOfDirtyTiles = dirtyTiles.size() * sizeof(unsigned int);
 
-		// Create the kernel to use.
-		cl::Kernel histogramKernel = cl::Kernel(Program, "histogramAtomic");
-		// Set kernel arguments.
-		histogramKernel.setArg(0, inputImageBuffer);
-		histogramKernel.setArg(1, histogramBuffer);
-		histogramKernel.setArg(2, BinSize);
+		// Borrow buffers for the previous histograms, the packed tiles and the tile numbers.
+		PooledBuffer histogramBuffer = Pool.Acquire(sizeOfHistogram);
+		const PooledBuffer previousTilesBuffer = Pool.Acquire(sizeOfTiles);
+		const PooledBuffer dirtyTilesBuffer = Pool.Acquire(sizeOfDirtyTiles);
 
-		// Create  an event for performance tracking.
-		cl::Event perfEvent;
-		// Queue the kernel for execution on the device.
-		Queue.enqueueNDRangeKernel(histogramKernel, cl::NullRange, cl::NDRange(imageColourChannelData.size()), cl::NullRange, NULL, &perfEvent);
+		// Copy the data to the device without blocking, the host data all outlives the run.
+		const vector<cl::Event> histogramWaitList = SharedParallel::After(Events);
+		cl::Event histogramEvent;
+		Queue.enqueueWriteBuffer(histogramBuffer, CL_FALSE, 0, sizeOfHistogram, &hist.data()[0], &histogramWaitList, &histogramEvent);
+		Events.push_back(make_pair(string("Write Histograms"), histogramEvent));
 
-		// Copy the result from the device to the host.
-		Queue.enqueueReadBuffer(histogramBuffer, CL_TRUE, 0, sizeOfHistogram, &hist.data()[0]);
+		const vector<cl::Event> tilesWaitList = SharedParallel::After(Events);
+		cl::Event tilesEvent;
+		Queue.enqueueWriteBuffer(previousTilesBuffer, CL_FALSE, 0, sizeOfTiles, &PreviousTiles.data()[0], &tilesWaitList, &tilesEvent);
+		Events.push_back(make_pair(string("Write Previous Tiles"), tilesEvent));
 
-		TotalDurationMs += GetProfilingTotalTimeMs(perfEvent);
+		const vector<cl::Event> dirtyTilesWaitList = SharedParallel::After(Events);
+		cl::Event dirtyTilesEvent;
+		Queue.enqueueWriteBuffer(dirtyTilesBuffer, CL_FALSE, 0, sizeOfDirtyTiles, &dirtyTiles.data()[0], &dirtyTilesWaitList, &dirtyTilesEvent);
+		Events.push_back(make_pair(string("Write Dirty Tiles"), dirtyTilesEvent));
 
-		// Print out the performance values.
-		cout << "\tBuild Histogram: " << GetFullProfilingInfo(perfEvent, ProfilingResolution::PROF_US) << endl;
+		// Get the kernel.
+		cl::Kernel& updateKernel = Kernels.Get("histogramUpdateTiles");
 
-		return hist;
-	}
+		// Set the kernel arguments.
+		updateKernel.setArg(0, previousTilesBuffer);
+		updateKernel.setArg(1, inputImageBuffer);
+		updateKernel.setArg(2, histogramBuffer);
+		updateKernel.setArg(3, dirtyTilesBuffer);
+		updateKernel.setArg(4, BinSize);
+		updateKernel.setArg(5, numberOfBins);
+		updateKernel.setArg(6, width);
+		updateKernel.setArg(7, height);
+		updateKernel.setArg(8, tileSize);
+
+		// Create  an event for performance tracking.
+		const vector<cl::Event> waitList = SharedParallel::After(Events);
+		cl::Event perfEvent;
 
-	void NormaliseToLookupTable(const size_t& sizeOfHistogram, vector<unsigned int>& histogram) {
+		// Queue the kernel for execution on the device, one work item per pixel of every dirty tile in every colour channel.
+		Queue.enqueueNDRangeKernel(updateKernel, cl::NullRange, cl::NDRange(tilePixels, channels, dirtyTiles.size()), cl::NullRange, &waitList, &perfEvent);
+		Events.push_back(make_pair("Update Histogram (" + to_string(dirtyTiles.size()) + " dirty tiles)", perfEvent));
 
-		// Create buffers for the histogram.
-		cl::Buffer histogramInputBuffer(Context, CL_MEM_READ_ONLY, sizeOfHistogram);
-		cl::Buffer histogramOutputBuffer(Context, CL_MEM_READ_WRITE, sizeOfHistogram);
+		return histogramBuffer;
+	}
 
-		// Get the maximum value from the histogram. Because it is cumulative, it is just the last value.
-		const unsigned int maxHistValue = histogram[histogram.size() - 1];
+	// Turn the cumulative histograms on the device into lookup tables, written to a device buffer for backprojection to read.
+	PooledBuffer NormaliseToLookupTable(const cl::Buffer& histogramInputBuffer, const unsigned int& channels, const unsigned int& numberOfBins) {
 
-		// Copy histogram data to device buffer memory.
-		Queue.enqueueWriteBuffer(histogramInputBuffer, CL_TRUE, 0, sizeOfHistogram, &histogram.data()[0]);
+		// The lookup table only holds pixel values, so it is stored the same way as the image whatever the counts are.
+		const size_t sizeOfLut = static_cast<size_t>(numberOfBins) * channels * sizeof(PixelType);
 
-		// Create the kernel.
-		cl::Kernel lutKernel = cl::Kernel(Program, "normaliseToLut");
+		// Borrow a buffer for the lookup tables.
+		PooledBuffer histogramOutputBuffer = Pool.Acquire(sizeOfLut);
 
-		// Set the kernel arguments.
+		// Get the kernel.
+		cl::Kernel& lutKernel = Kernels.Get("normaliseToLut");
+
+		// Set the kernel arguments. The kernel finds each channel's maximum itself from the end of its cumulative histogram.
 		lutKernel.setArg(0, histogramInputBuffer);
-		lutKernel.setArg(1, maxHistValue);
-		lutKernel.setArg(2, histogramOutputBuffer);
-		lutKernel.setArg(3, MaxPixelValue);
+		lutKernel.setArg(1, histogramOutputBuffer);
+		lutKernel.setArg(2, MaxPixelValue);
 
 		// Create  an event for performance tracking.
+		const vector<cl::Event> waitList = SharedParallel::After(Events);
 		cl::Event perfEvent;
 
-		// Queue the kernel for execution on the device.
-		Queue.enqueueNDRangeKernel(lutKernel, cl::NullRange, cl::NDRange(histogram.size()), cl::NullRange, NULL, &perfEvent);
-
-		// Copy the result from the output buffer on the device to the host.
-		Queue.enqueueReadBuffer(histogramOutputBuffer, CL_TRUE, 0, sizeOfHistogram, &histogram.data()[0]);
-
-		TotalDurationMs += GetProfilingTotalTimeMs(perfEvent);
+		// Queue the kernel for execution on the device, one row per colour channel.
+		Queue.enqueueNDRangeKernel(lutKernel, cl::NullRange, cl::NDRange(numberOfBins, channels), cl::NullRange, &waitList, &perfEvent);
+		Events.push_back(make_pair(string("Normalise to lookup"), perfEvent));
 
-		// Print out the performance values.
-		cout << "\tNormalise to lookup: " << GetFullProfilingInfo(perfEvent, ProfilingResolution::PROF_US) << endl;
+		return histogramOutputBuffer;
 	}
 
 
-	vector<unsigned short> Backprojection(const vector<unsigned short>& imageColourChannelData, const size_t sizeOfImageChannel, const vector<unsigned int>& histogram, const size_t& sizeOfHistogram, const unsigned char& colourChannel) {
+	// Copy the whole image to the device, or on devices that share memory with the host use it where it is. Starts a new image's events.
+	// The write doesn't block, every command after it waits on the one before so nothing reads the image early.
+	PooledBuffer UploadImage(const size_t& sizeOfImage) {
+		Events.clear();
+		if (CanUseInPlace(Kernels.GetDevice(), InputImage.data())) {
+			return Pool.WrapHostMemory(InputImage.data(), sizeOfImage, CL_MEM_READ_ONLY);
+		}
 
-		// Create buffers to store the data on the device.
-		cl::Buffer inputImageBuffer(Context, CL_MEM_READ_ONLY, sizeOfImageChannel);
-		cl::Buffer inputHistBuffer(Context, CL_MEM_READ_ONLY, sizeOfHistogram);
-		cl::Buffer outputImageBuffer(Context, CL_MEM_READ_WRITE, sizeOfImageChannel);
+		PooledBuffer inputImageBuffer = Pool.Acquire(sizeOfImage);
+		cl::Event writeEvent;
+		Queue.enqueueWriteBuffer(inputImageBuffer, CL_FALSE, 0, sizeOfImage, &InputImage.data()[0], NULL, &writeEvent);
+		Events.push_back(make_pair(string("Write Image"), writeEvent));
+		return inputImageBuffer;
+	}
 
-		// Write the data for the input image and histogram lookup table to the buffers.
-		Queue.enqueueWriteBuffer(inputImageBuffer, CL_TRUE, 0, sizeOfImageChannel, &imageColourChannelData.data()[0]);
-		Queue.enqueueWriteBuffer(inputHistBuffer, CL_TRUE, 0, sizeOfHistogram, &histogram.data()[0]);
+	// Queue the backprojection of pixelCount pixels of every channel through the lookup tables, the channels are stored pixelCount apart.
+	void EnqueueBackprojectionKernel(const cl::Buffer& inputImageBuffer, const cl::Buffer& lutBuffer, const cl::Buffer& outputImageBuffer, const size_t pixelCount, const unsigned int& channels, const unsigned int& numberOfBins, const vector<cl::Event>& waitList, cl::Event& perfEvent) {
+		// Get the kernel
+		cl::Kernel& backPropKernel = Kernels.Get("backprojectionCoarse");
 
-		// Create the kernel
-		cl::Kernel backPropKernel = cl::Kernel(Program, "backprojection");
+		// Work out how many pixels each work item should process on this device, and how many work items that needs per channel.
+		const unsigned int pixelsPerItem = SharedParallel::GetPixelsPerWorkItem(Kernels.GetDevice(), pixelCount);
+		const size_t workItems = (pixelCount + pixelsPerItem - 1) / pixelsPerItem;
 
 		// Set the kernel arguments.
 		backPropKernel.setArg(0, inputImageBuffer);
-		backPropKernel.setArg(1, inputHistBuffer);
+		backPropKernel.setArg(1, lutBuffer);
 		backPropKernel.setArg(2, outputImageBuffer);
 		backPropKernel.setArg(3, BinSize);
+		backPropKernel.setArg(4, numberOfBins);
+		backPropKernel.setArg(5, pixelsPerItem);
+		backPropKernel.setArg(6, static_cast<CountType>(pixelCount));
+
+		// Execute the kernel on the device, one row of work items per colour channel.
+		Queue.enqueueNDRangeKernel(backPropKernel, cl::NullRange, cl::NDRange(workItems, channels), cl::NullRange, &waitList, &perfEvent);
+	}
+
+	// Backproject the image and queue the copy of the result into outputData, which must stay alive until the events are waited for.
+	// On devices that share memory with the host the kernel writes straight into outputData when it is page aligned.
+	void Backprojection(const cl::Buffer& inputImageBuffer, const size_t& sizeOfImage, const cl::Buffer& inputHistBuffer, const unsigned int& channels, const unsigned int& numberOfBins, PixelType* outputData) {
+
+		// Borrow a buffer for the output image, the image and lookup tables are already on the device.
+		const cl::Device& device = Kernels.GetDevice();
+		const bool outputInPlace = CanUseInPlace(device, outputData);
+		const PooledBuffer outputImageBuffer = outputInPlace ? Pool.WrapHostMemory(outputData, sizeOfImage, CL_MEM_WRITE_ONLY) : Pool.Acquire(sizeOfImage);
 
 		// Create  an event for performance tracking.
 		cl::Event perfEvent;
+		EnqueueBackprojectionKernel(inputImageBuffer, inputHistBuffer, outputImageBuffer, ImageSize, channels, numberOfBins, SharedParallel::After(Events), perfEvent);
+		Events.push_back(make_pair(string("Backprojection"), perfEvent));
+
+		if (outputInPlace) {
+			// Mapping the output makes sure the host sees what the kernel wrote, which costs nothing when the memory is shared.
+			const vector<cl::Event> mapWaitList = SharedParallel::After(Events);
+			cl::Event mapEvent;
+			void* mappedOutput = Queue.enqueueMapBuffer(outputImageBuffer, CL_FALSE, CL_MAP_READ, 0, sizeOfImage, &mapWaitList, &mapEvent);
+			Events.push_back(make_pair(string("Map Output Image"), mapEvent));
+
+			const vector<cl::Event> unmapWaitList = SharedParallel::After(Events);
+			cl::Event unmapEvent;
+			Queue.enqueueUnmapMemObject(outputImageBuffer, mappedOutput, &unmapWaitList, &unmapEvent);
+			Events.push_back(make_pair(string("Unmap Output Image"), unmapEvent));
+		}
+		else {
+			// Copy the output from the device buffer to the host without blocking, it is waited for along with everything else.
+			const vector<cl::Event> readWaitList = SharedParallel::After(Events);
+			cl::Event readEvent;
+			Queue.enqueueReadBuffer(outputImageBuffer, CL_FALSE, 0, sizeOfImage, outputData, &readWaitList, &readEvent);
+			Events.push_back(make_pair(string("Read Output Image"), readEvent));
+		}
+	}
+
+	// Scan the histograms and turn them into lookup tables, which stay on the device.
+	PooledBuffer BuildLookupTables(PooledBuffer&& histogramBuffer, const unsigned int& channels, const unsigned int& numberOfBins) {
+		// Keep the raw counts so the next frame can be equalised incrementally from them.
+		HistogramBuffer = move(histogramBuffer);
+		HistogramCount = static_cast<size_t>(numberOfBins) * channels;
+
+		PooledBuffer lutBuffer;
+		if (CumulativeSumAlgorithm == SharedParallel::SCAN_AUTO && Dispatch != nullptr && Dispatch->ScanAndNormalise.PreferHost(HistogramCount)) {
+			// Small histograms are cheaper to copy back, scan and normalise on the host than to launch kernels for.
+			lutBuffer = Pool.Acquire(HistogramCount * sizeof(PixelType));
+
+			high_resolution_clock::time_point start = high_resolution_clock::now();
+			SharedParallel::ScanAndNormaliseOnHost<CountType, PixelType>(Queue, HistogramBuffer, lutBuffer, numberOfBins, channels, MaxPixelValue, Events);
+			const double durationUs = duration<double, micro>(high_resolution_clock::now() - start).count();
+
+			TotalDurationMs += durationUs / 1000;
+			cout << "\tHost Scan and Normalise (cheaper than the device for " << HistogramCount << " bins): " << durationUs << " [us]" << endl;
+		}
+		else {
+			// Run cumulative sum on all the histograms at once, they are scanned back to back and separated again when normalising.
+			const PooledBuffer cumulativeHistogramBuffer = Pool.Acquire(HistogramCount * sizeof(CountType));
+			SharedParallel::CumulativeSumBuffer<CountType>(Kernels, Pool, Queue, HistogramBuffer, cumulativeHistogramBuffer, HistogramCount, Events, CumulativeSumAlgorithm);
+
+			// Normalise and Create a lookup table for every channel from the cumulative histograms.
+			lutBuffer = NormaliseToLookupTable(cumulativeHistogramBuffer, channels, numberOfBins);
+		}
+
+		if (SampleStride > 1) {
+			// The lookup tables are only copied back to the host for this check, which has to wait for them.
+			vector<PixelType> lut(HistogramCount);
+			const vector<cl::Event> lutWaitList = SharedParallel::After(Events);
+			Queue.enqueueReadBuffer(lutBuffer, CL_TRUE, 0, lut.size() * sizeof(PixelType), &lut.data()[0], &lutWaitList);
+
+			// The device and the host scan both normalise in double.
+			double referenceDurationMs = 0;
+			SerialProcessor<PixelType, CountType> referenceProc(InputImage, BinSize, referenceDurationMs, MaxPixelValue, ImageSize, SampleStride);
+			referenceProc.template ReportSampledLookupTableDeviation<double>(vector<unsigned int>(lut.begin(), lut.end()), "strips");
+		}
+
+		return lutBuffer;
+	}
+
+	// Scan the histograms, turn them into lookup tables and backproject the image with them.
+	// Everything stays on the device from the histograms to the output image, nothing is copied to or from the host in between.
+	void EqualiseFromHistogram(const cl::Buffer& inputImageBuffer, const size_t& sizeOfImage, PooledBuffer&& histogramBuffer, const unsigned int& channels, const unsigned int& numberOfBins, PixelType* outputData) {
+		const PooledBuffer lutBuffer = BuildLookupTables(move(histogramBuffer), channels, numberOfBins);
+
+		// BackProject every channel with its histogram lookup table.
+		Backprojection(inputImageBuffer, sizeOfImage, lutBuffer, channels, numberOfBins, outputData);
+	}
+
+	// Copy the whole image to the device and queue everything needed to equalise it, without waiting for any of it.
+	// The output is read into outputData, which must stay alive until the events are waited for.
+	void EnqueueHistogramEqualisation(PixelType* outputData) {
+		// Every colour channel is processed together, each kernel launch covers all of them.
+		const unsigned int channels = InputImage.spectrum();
 
-		// Execute the kernel on the device.
-		Queue.enqueueNDRangeKernel(backPropKernel, cl::NullRange, cl::NDRange(imageColourChannelData.size()), cl::NullRange, NULL, &perfEvent);
+		// Calculate the number of bins needed. Cast to float so a bin size that doesn't divide the range still gets a final partial bin.
+		const unsigned int numberOfBins = ceil((MaxPixelValue + 1) / static_cast<float>(BinSize));
 
-		// Create the vector to store the output data.-
-		vector<unsigned short> outputData(imageColourChannelData.size());
+		// The image is stored planar, so the whole image can go to the device in one copy.
+		const size_t sizeOfImage = InputImage.size() * sizeof(PixelType);
 
-		// Copy the output from the device buffer to the output vector on the host.
-		Queue.enqueueReadBuffer(outputImageBuffer, CL_TRUE, 0, sizeOfImageChannel, &outputData.data()[0]);
+		// Copy the whole image to the device once, it is read by both the histogram and backprojection.
+		const PooledBuffer inputImageBuffer = UploadImage(sizeOfImage);
 
-		TotalDurationMs += GetProfilingTotalTimeMs(perfEvent);
+		// Build a histogram for every channel in a single pass.
+		PooledBuffer histogramBuffer = BuildImageHistogram(inputImageBuffer, channels, numberOfBins);
 
-		// Print out the performance values.
-		cout << "\tBackprojection: " << GetFullProfilingInfo(perfEvent, ProfilingResolution::PROF_US) << endl;
+		EqualiseFromHistogram(inputImageBuffer, sizeOfImage, move(histogramBuffer), channels, numberOfBins, outputData);
+	}
+
+	// Queue a copy of rows of every channel of the image to or from a band buffer, without blocking.
+	void EnqueueBandCopy(const cl::CommandQueue& queue, const bool toDevice, const cl::Buffer& bandBuffer, PixelType* image, const size_t firstRow, const size_t rows, const vector<cl::Event>& waitList, cl::Event& event) {
+		SharedParallel::EnqueueBandCopy(queue, toDevice, bandBuffer, image, InputImage.width() * sizeof(PixelType), ImageSize * sizeof(PixelType), InputImage.spectrum(), firstRow, rows, waitList, event);
+	}
+
+	// Wait for the image's commands, this is the one place the image waits for the device, then print their performance values.
+	CImg<PixelType> WaitForOutput(const HostVector<PixelType>& outputData) {
+		SharedParallel::ReportEvents(Events, TotalDurationMs);
+
+		cout << endl << "Total Kernel Duration: " << TotalDurationMs << "ms" << endl;
 
-		return outputData;
+		// Create the image from the output data.
+		CImg<PixelType> outputImage(outputData.data(), InputImage.width(), InputImage.height(), InputImage.depth(), InputImage.spectrum());
+
+		return outputImage;
 	}
 
 public:
-	ParallelProcessor(cl::Program& program, cl::Context& context, cl::CommandQueue& queue, CImg<unsigned short>& inputImage, unsigned int& binSize, double& totalDurationMs, unsigned int& imageSize, unsigned short& maxPixelValue, int& deviceId) :
-		Program(program),
-		Context(context),
+	// Kernels come from the registry and device buffers are borrowed from the pool, both must outlive the processor.
+	ParallelProcessor(KernelRegistry& kernels, BufferPool& pool, cl::CommandQueue& queue, CImg<PixelType>& inputImage, unsigned int& binSize, double& totalDurationMs, size_t& imageSize, unsigned short& maxPixelValue, int& deviceId, const unsigned int sampleStride = 1, const SharedParallel::ScanAlgorithm scanAlgorithm = SharedParallel::SCAN_AUTO, const SharedParallel::DispatchModel* dispatchModel = nullptr) :
+		Kernels(kernels),
+		Pool(pool),
 		Queue(queue),
 		InputImage(inputImage),
 		BinSize(binSize),
 		TotalDurationMs(totalDurationMs),
 		ImageSize(imageSize),
 		MaxPixelValue(maxPixelValue),
-		DeviceId(deviceId) {}
+		DeviceId(deviceId),
+		SampleStride(sampleStride),
+		CumulativeSumAlgorithm(scanAlgorithm),
+		Dispatch(dispatchModel) {}
+
+	CImg<PixelType> RunHistogramEqualisation() {
+		// The input and output images have to be on the device at once, each in a single buffer. Anything bigger is equalised a band at a time.
+		const size_t sizeOfImage = InputImage.size() * sizeof(PixelType);
+		if (!SharedParallel::FitsOnDevice(Kernels.GetDevice(), sizeOfImage, 2 * sizeOfImage)) {
+			cout << endl << "The image is too large for the device to hold its input and output at once." << endl;
+			return RunTiledHistogramEqualisation();
+		}
 
-	CImg<unsigned short> RunHistogramEqualisation() {
 		cout << endl << "Running parallel Histogram Equalisation..." << endl;
 
-		// Allocate a vector to store all channels of the output image.
-		vector<unsigned short> outputImageData(InputImage.size());
+		cout << endl << "Processing " << InputImage.spectrum() << " Colour Channel(s)" << endl;
 
-		// Declare size of histogram (stored as number of bytes), the value is assigned by the build histogram method.
-		size_t sizeOfHistogram, sizeOfImageChannel;
+		HostVector<PixelType> outputData(InputImage.size());
+		EnqueueHistogramEqualisation(outputData.data());
 
-		for (unsigned char colourChannel = 0; colourChannel < InputImage.spectrum(); colourChannel++) {
-			cout << endl << "Processing Colour Channel " << (int)colourChannel << endl;
+		return WaitForOutput(outputData);
+	}
 
-			// Get the selected colour channel data out of the image.
-			CImg<unsigned short>::const_iterator first = InputImage.begin() + (ImageSize * colourChannel);
-			CImg<unsigned short>::const_iterator last = InputImage.begin() + (ImageSize * colourChannel) + ImageSize;
-			vector<unsigned short> imageColourChannelData(first, last);
+	// Equalise each colour channel on a lane of its own, so the commands of different channels can run at the same time,
+	// e.g. the upload of one channel alongside the histogram of another. The commands of a channel still run one after another.
+	// A lane is made for each channel the first time an image needs it, and kept for later images.
+	CImg<PixelType> RunHistogramEqualisationPerChannel(vector<SharedParallel::QueueLane>& lanes) {
+		cout << endl << "Running parallel Histogram Equalisation with overlapped colour channels..." << endl;
 
-			sizeOfImageChannel = imageColourChannelData.size() * sizeof(unsigned short);
+		const unsigned int channels = InputImage.spectrum();
+		cout << endl << "Processing " << channels << " Colour Channel(s) on " << channels << " queue(s)" << endl;
 
-			// Build a histogram from the input image and get its size out.
-			vector<unsigned int> hist = BuildImageHistogram(imageColourChannelData, sizeOfImageChannel, colourChannel, sizeOfHistogram);
+		while (lanes.size() < channels) {
+			lanes.emplace_back(Pool.GetContext(), Kernels.GetDevice());
+		}
 
-			// Run cumulative sum on the histogram.
-			hist = SharedParallel::CumulativeSumParallel(Program, Context, Queue, DeviceId, hist, TotalDurationMs);
+		// The image is planar, so each channel can be shared as an image of its own rather than copied.
+		// Each gets a processor on its lane, every one of them adds to this processor's total.
+		vector<CImg<PixelType>> channelImages;
+		vector<ParallelProcessor> channelProcs;
+		channelImages.reserve(channels);
+		channelProcs.reserve(channels);
+		HostVector<PixelType> outputData(InputImage.size());
+
+		// Queue every channel before waiting for any of them.
+		for (unsigned int c = 0; c < channels; c++) {
+			channelImages.push_back(InputImage.get_shared_channel(c));
+			channelProcs.emplace_back(Kernels, lanes[c].Pool, lanes[c].Queue, channelImages[c], BinSize, TotalDurationMs, ImageSize, MaxPixelValue, DeviceId, SampleStride, CumulativeSumAlgorithm, Dispatch);
+			channelProcs[c].EnqueueHistogramEqualisation(outputData.data() + c * ImageSize);
+		}
+
+		// Print each channel's commands, then compare the time all of them took with the time they would take one after another.
+		cl_ulong firstStart = numeric_limits<cl_ulong>::max();
+		cl_ulong lastEnd = 0;
+		double sequentialMs = 0;
+		for (unsigned int c = 0; c < channels; c++) {
+			cout << endl << "Channel " << c << ":" << endl;
+			SharedParallel::ReportEvents(channelProcs[c].Events, TotalDurationMs);
+
+			cl_ulong channelStart, channelEnd;
+			SharedParallel::GetTimeline(channelProcs[c].Events, channelStart, channelEnd);
+			sequentialMs += (channelEnd - channelStart) / static_cast<double>(ProfilingResolution::PROF_MS);
+			firstStart = min(firstStart, channelStart);
+			lastEnd = max(lastEnd, channelEnd);
+		}
 
-			// Normalise and Create a lookup table from the cumulative histogram.
-			NormaliseToLookupTable(sizeOfHistogram, hist);
+		const double overlappedMs = (lastEnd - firstStart) / static_cast<double>(ProfilingResolution::PROF_MS);
+		cout << endl << "Channel Overlap: " << overlappedMs << "ms for every channel, " << sequentialMs << "ms one after another";
+		// Tiny images or a coarse profiling timer can report no time at all.
+		if (sequentialMs > 0) {
+			cout << " (" << (100 * (1 - overlappedMs / sequentialMs)) << "% saved)";
+		}
+		cout << endl;
+		cout << "Total Kernel Duration: " << TotalDurationMs << "ms" << endl;
+
+		// Create the image from the output data.
+		CImg<PixelType> outputImage(outputData.data(), InputImage.width(), InputImage.height(), InputImage.depth(), InputImage.spectrum());
 
-			// BackProject with histogram lookup table.
-			vector<unsigned short> outputData = Backprojection(imageColourChannelData, sizeOfImageChannel, hist, sizeOfHistogram, colourChannel);
+		return outputImage;
+	}
+
+	// Equalise an image too big for the device a band of rows at a time, only four bands are ever on the device.
+	// The first pass streams the bands through the histogram kernel, counting them all into one set of histograms. The second streams them
+	// through backprojection with the lookup tables from those. Bands are double buffered, with the copies on a second queue, so one band
+	// is copied while the kernel runs on another.
+	CImg<PixelType> RunTiledHistogramEqualisation() {
+		cout << endl << "Running tiled parallel Histogram Equalisation..." << endl;
+
+		const unsigned int channels = InputImage.spectrum();
+		const unsigned int numberOfBins = ceil((MaxPixelValue + 1) / static_cast<float>(BinSize));
+		const size_t width = InputImage.width();
+		const size_t height = InputImage.height();
+
+		// Four band buffers, an input and an output for each of the two bands in flight.
+		const size_t rowBytes = width * channels * sizeof(PixelType);
+		const size_t bandRows = SharedParallel::GetBandRows(Kernels.GetDevice(), height, 4 * rowBytes, rowBytes);
+		if (bandRows == 0) {
+			throw runtime_error("The image is " + to_string(width) + " pixels wide, too wide for a single row to fit in this device's memory.");
+		}
+		const size_t numberOfBands = (height + bandRows - 1) / bandRows;
+		const size_t bandBytes = bandRows * width * channels * sizeof(PixelType);
+
+		cout << endl << "Processing " << channels << " Colour Channel(s) in " << numberOfBands << " band(s) of up to " << bandRows << " rows" << endl;
+
+		// The copies run on a queue of their own so they can overlap the kernels, events order the commands across the two queues.
+		cl::CommandQueue transferQueue(Pool.GetContext(), Kernels.GetDevice(), CL_QUEUE_PROFILING_ENABLE);
+
+		// Two of each band buffer, so one band can be copied while the other is processed.
+		const PooledBuffer inputBands[2] = { Pool.Acquire(bandBytes), Pool.Acquire(bandBytes) };
+		const PooledBuffer outputBands[2] = { Pool.Acquire(bandBytes), Pool.Acquire(bandBytes) };
+
+		// Pass 1, count every band into one set of histograms.
+		Events.clear();
+		const size_t sizeOfHistogram = static_cast<size_t>(numberOfBins) * channels * sizeof(CountType);
+		PooledBuffer histogramBuffer = Pool.Acquire(sizeOfHistogram);
+		cl::Event fillEvent;
+		Queue.enqueueFillBuffer(histogramBuffer, static_cast<CountType>(0), 0, sizeOfHistogram, NULL, &fillEvent);
+		Events.push_back(make_pair(string("Clear Histograms"), fillEvent));
+
+		vector<cl::Event> uploadEvents(numberOfBands);
+		vector<cl::Event> countEvents(numberOfBands);
+		for (size_t band = 0; band < numberOfBands; band++) {
+			const size_t firstRow = band * bandRows;
+			const size_t rows = min(bandRows, height - firstRow);
+			const string bandName = "Band " + to_string(band) + " ";
+
+			// A band buffer can be refilled once the band two before it has been counted.
+			const vector<cl::Event> uploadWaitList = band >= 2 ? vector<cl::Event>(1, countEvents[band - 2]) : vector<cl::Event>();
+			EnqueueBandCopy(transferQueue, true, inputBands[band % 2], InputImage.data(), firstRow, rows, uploadWaitList, uploadEvents[band]);
+			Events.push_back(make_pair(bandName + "Write", uploadEvents[band]));
+
+			// The counts run one after another on the main queue, after the histograms are cleared.
+			const vector<cl::Event> countWaitList(1, uploadEvents[band]);
+			const string kernelName = EnqueueHistogramKernel(inputBands[band % 2], histogramBuffer, rows * width, channels, numberOfBins, countWaitList, countEvents[band]);
+			Events.push_back(make_pair(bandName + "Histogram (" + kernelName + ")", countEvents[band]));
+		}
 
-			// Copy the channel to the output image data vector in the appropriate channel position.
-			std::copy(outputData.begin(), outputData.end(), outputImageData.begin() + (ImageSize * colourChannel));
+		// The last count is the last of the main queue, so the scan waits for every band.
+		const PooledBuffer lutBuffer = BuildLookupTables(move(histogramBuffer), channels, numberOfBins);
+		const cl::Event lutEvent = Events.back().second;
+
+		// Pass 2, backproject every band with the lookup tables straight into the output image.
+		// The next band is copied to the device before this one is copied back, so the copy in overlaps this band's kernel.
+		CImg<PixelType> outputImage(InputImage.width(), InputImage.height(), InputImage.depth(), channels);
+		vector<cl::Event> backprojectionEvents(numberOfBands);
+		vector<cl::Event> downloadEvents(numberOfBands);
+		for (size_t band = 0; band < numberOfBands + 1; band++) {
+			if (band < numberOfBands) {
+				// The input buffers were last read by the first pass, and after that by the band two before.
+				const size_t firstRow = band * bandRows;
+				const vector<cl::Event> uploadWaitList(1, band >= 2 ? backprojectionEvents[band - 2] : lutEvent);
+				EnqueueBandCopy(transferQueue, true, inputBands[band % 2], InputImage.data(), firstRow, min(bandRows, height - firstRow), uploadWaitList, uploadEvents[band]);
+				Events.push_back(make_pair("Band " + to_string(band) + " Write", uploadEvents[band]));
+			}
+
+			if (band == 0) {
+				continue;
+			}
+
+			const size_t current = band - 1;
+			const size_t firstRow = current * bandRows;
+			const size_t rows = min(bandRows, height - firstRow);
+			const string bandName = "Band " + to_string(current) + " ";
+
+			// Backprojection also needs the lookup tables, and its output buffer to have been copied back from the band two before.
+			vector<cl::Event> backprojectionWaitList(1, uploadEvents[current]);
+			backprojectionWaitList.push_back(current >= 2 ? downloadEvents[current - 2] : lutEvent);
+			EnqueueBackprojectionKernel(inputBands[current % 2], lutBuffer, outputBands[current % 2], rows * width, channels, numberOfBins, backprojectionWaitList, backprojectionEvents[current]);
+			Events.push_back(make_pair(bandName + "Backprojection", backprojectionEvents[current]));
+
+			const vector<cl::Event> downloadWaitList(1, backprojectionEvents[current]);
+			EnqueueBandCopy(transferQueue, false, outputBands[current % 2], outputImage.data(), firstRow, rows, downloadWaitList, downloadEvents[current]);
+			Events.push_back(make_pair(bandName + "Read", downloadEvents[current]));
 		}
-		
+
+		// This is the one place the image waits for the device, both queues must be done before the band buffers go back to the pool.
+		transferQueue.finish();
+		Queue.finish();
+		SharedParallel::ReportEvents(Events, TotalDurationMs);
+
 		cout << endl << "Total Kernel Duration: " << TotalDurationMs << "ms" << endl;
 
-		// Create the image from the output data.
-		CImg<unsigned short> outputImage(outputImageData.data(), InputImage.width(), InputImage.height(), InputImage.depth(), InputImage.spectrum());
+		return outputImage;
+	}
+
+	// Equalise an image that is nearly identical to the previous one without recounting every pixel. The previous frame's histograms
+	// are adjusted using only the dirty tiles, tileSize x tileSize squares of pixels numbered row by row, see FindDirtyTiles.
+	// The histograms are updated in place so they can be passed straight on to the next frame.
+	CImg<PixelType> RunIncrementalHistogramEqualisation(const CImg<PixelType>& previousImage, vector<CountType>& histogram, const vector<unsigned int>& dirtyTiles, const unsigned int tileSize) {
+		cout << endl << "Running incremental parallel Histogram Equalisation..." << endl;
+
+		const unsigned int channels = InputImage.spectrum();
+		const unsigned int numberOfBins = ceil((MaxPixelValue + 1) / static_cast<float>(BinSize));
+		const size_t sizeOfImage = InputImage.size() * sizeof(PixelType);
+
+		cout << endl << "Processing " << channels << " Colour Channel(s)" << endl;
+
+		// The whole image is still needed on the device, every pixel is backprojected through the new lookup tables.
+		const PooledBuffer inputImageBuffer = UploadImage(sizeOfImage);
+
+		// Nothing to count if no tiles changed, the histograms just need to go to the device.
+		PooledBuffer histogramBuffer;
+		if (!dirtyTiles.empty()) {
+			histogramBuffer = UpdateImageHistogram(inputImageBuffer, previousImage, histogram, dirtyTiles, tileSize, channels, numberOfBins);
+		}
+		else {
+			histogramBuffer = Pool.Acquire(histogram.size() * sizeof(CountType));
+			const vector<cl::Event> histogramWaitList = SharedParallel::After(Events);
+			cl::Event histogramEvent;
+			Queue.enqueueWriteBuffer(histogramBuffer, CL_FALSE, 0, histogram.size() * sizeof(CountType), &histogram.data()[0], &histogramWaitList, &histogramEvent);
+			Events.push_back(make_pair(string("Write Histograms"), histogramEvent));
+		}
+
+		HostVector<PixelType> outputData(InputImage.size());
+		EqualiseFromHistogram(inputImageBuffer, sizeOfImage, move(histogramBuffer), channels, numberOfBins, outputData.data());
+		CImg<PixelType> outputImage = WaitForOutput(outputData);
+
+		// Hand the updated histograms back once the image is done.
+		histogram = GetHistogram();
 
 		return outputImage;
 	}
+
+	// Get the raw histograms of every channel from the last run, to pass on when equalising the next frame incrementally.
+	// They are copied back from the device on request.
+	vector<CountType> GetHistogram() {
+		vector<CountType> histogram(HistogramCount);
+		if (HistogramCount > 0) {
+			Queue.enqueueReadBuffer(HistogramBuffer, CL_TRUE, 0, HistogramCount * sizeof(CountType), &histogram.data()[0]);
+		}
+		return histogram;
+	}
+
+	// Find the tiles that differ between two images of the same size, as tileSize x tileSize squares of pixels numbered row by row.
+	static vector<unsigned int> FindDirtyTiles(const CImg<PixelType>& previousImage, const CImg<PixelType>& currentImage, const unsigned int tileSize) {
+		const unsigned int width = currentImage.width();
+		const unsigned int tilesPerRow = (width + tileSize - 1) / tileSize;
+		const unsigned int tilesPerColumn = (currentImage.height() + tileSize - 1) / tileSize;
+		vector<bool> dirty(static_cast<size_t>(tilesPerRow) * tilesPerColumn, false);
+
+		// Compare a tile's worth of each row at a time, skipping tiles already known to have changed.
+		for (int c = 0; c < currentImage.spectrum(); c++) {
+			for (int y = 0; y < currentImage.height(); y++) {
+				const PixelType* previousRow = previousImage.data(0, y, 0, c);
+				const PixelType* currentRow = currentImage.data(0, y, 0, c);
+				for (unsigned int tileX = 0; tileX < tilesPerRow; tileX++) {
+					const size_t tile = static_cast<size_t>(y / tileSize) * tilesPerRow + tileX;
+					const unsigned int start = tileX * tileSize;
+					const unsigned int end = min(start + tileSize, width);
+					if (!dirty[tile] && !equal(previousRow + start, previousRow + end, currentRow + start)) {
+						dirty[tile] = true;
+					}
+				}
+			}
+		}
+
+		vector<unsigned int> dirtyTiles;
+		for (size_t tile = 0; tile < dirty.size(); tile++) {
+			if (dirty[tile]) {
+				dirtyTiles.push_back(static_cast<unsigned int>(tile));
+			}
+		}
+		return dirtyTiles;
+	}
+
 };
\ No newline at end of file
@@ -1,28 +1,342 @@
-kernel void histogramAtomic(global const ushort* inputImage, global uint* histogram, const uint binSize) {
-	int id = get_global_id(0);
+// Counts every pixel straight into the global histogram with atomics. Each work item reads pixelsPerItem pixels using vector loads of 8,
+// laid out as described above stripStart. pixelsPerItem must be a multiple of 8, any ragged tail at the end of the channel is read one pixel at a time.
+// To build a sampled histogram only 1 in sampleStride strips or vectors is counted. All the histogram kernels share this.
+// The second dimension of the NDRange selects the colour channel, so every channel of a planar image is counted in a single pass
+// into its own histogram of numberOfBins bins.
+kernel void histogramCoarse(global const pixel_t* inputImage, global count_t* histogram, const uint binSize, const uint numberOfBins, const uint pixelsPerItem, const uint sampleStride, const count_t inputCount) {
+	uint channel = get_global_id(1);
+
+	// Move to the start of this channel's pixels and histogram.
+	inputImage += channel * inputCount;
+	histogram += channel * numberOfBins;
+
+	count_t i = stripStart(pixelsPerItem, sampleStride);
+	count_t step = stripStep(sampleStride);
+	uint k = 0;
+	for (; k < pixelsPerItem / 8 && i + 8 <= inputCount; k++, i += step) {
+		// Get the bin indices of 8 pixels at once, this integer division is always floored toward zero.
+		uint8 binIndices = convert_uint8(vload8(0, inputImage + i)) / binSize;
+
+		countAdd(&histogram[binIndices.s0], 1);
+		countAdd(&histogram[binIndices.s1], 1);
+		countAdd(&histogram[binIndices.s2], 1);
+		countAdd(&histogram[binIndices.s3], 1);
+		countAdd(&histogram[binIndices.s4], 1);
+		countAdd(&histogram[binIndices.s5], 1);
+		countAdd(&histogram[binIndices.s6], 1);
+		countAdd(&histogram[binIndices.s7], 1);
+	}
+
+	// Ragged tail, only the work item whose next vector runs past the end of the channel has one, it is read one pixel at a time.
+	if (k < pixelsPerItem / 8) {
+		for (; i < inputCount; i++) {
+			countAdd(&histogram[inputImage[i] / binSize], 1);
+		}
+	}
+}
+
+// A privatised version of histogramCoarse. Each work group accumulates into its own sub-histogram in local memory
+// and merges it into the global histogram once at the end, so work items only contend with their own group.
+// Requires a single channel's histogram to fit in local memory, the local size must be 1 in the channel dimension.
+kernel void histogramLocal(global const pixel_t* inputImage, global count_t* histogram, const uint binSize, const uint numberOfBins, const uint pixelsPerItem, const uint sampleStride, const count_t inputCount, local uint* localHistogram) {
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+	uint channel = get_global_id(1);
+
+	// Move to the start of this channel's pixels and histogram.
+	inputImage += channel * inputCount;
+	histogram += channel * numberOfBins;
+
+	// Clear the local histogram, each work item clears every Nth bin.
+	for (uint bin = lid; bin < numberOfBins; bin += N) {
+		localHistogram[bin] = 0;
+	}
+
+	// Wait for the whole local histogram to be cleared before counting.
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// The global size is padded up to a multiple of the local size, the extra work items start past the end of the image and read nothing.
+	count_t i = stripStart(pixelsPerItem, sampleStride);
+	count_t step = stripStep(sampleStride);
+	uint k = 0;
+	for (; k < pixelsPerItem / 8 && i + 8 <= inputCount; k++, i += step) {
+		// Get the bin indices of 8 pixels at once, this integer division is always floored toward zero.
+		uint8 binIndices = convert_uint8(vload8(0, inputImage + i)) / binSize;
+
+		atomic_inc(&localHistogram[binIndices.s0]);
+		atomic_inc(&localHistogram[binIndices.s1]);
+		atomic_inc(&localHistogram[binIndices.s2]);
+		atomic_inc(&localHistogram[binIndices.s3]);
+		atomic_inc(&localHistogram[binIndices.s4]);
+		atomic_inc(&localHistogram[binIndices.s5]);
+		atomic_inc(&localHistogram[binIndices.s6]);
+		atomic_inc(&localHistogram[binIndices.s7]);
+	}
+
+	// Ragged tail, only the work item whose next vector runs past the end of the channel has one, it is read one pixel at a time.
+	if (k < pixelsPerItem / 8) {
+		for (; i < inputCount; i++) {
+			atomic_inc(&localHistogram[inputImage[i] / binSize]);
+		}
+	}
+
+	// Wait for the whole group to finish counting.
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Merge the sub-histogram into the global histogram, skipping empty bins to save on global atomics.
+	for (uint bin = lid; bin < numberOfBins; bin += N) {
+		uint count = localHistogram[bin];
+		if (count > 0) {
+			countAdd(&histogram[bin], count);
+		}
+	}
+}
+
+// Counts a bin into a work group's local slice of the histogram if it falls within that slice.
+// Bins below the start of the slice wrap around to large unsigned values so they fail the same test as bins past the end.
+void countInSlice(local uint* localHistogram, uint binIndex, uint sliceStart, uint sliceCount) {
+	uint sliceIndex = binIndex - sliceStart;
+	if (sliceIndex < sliceCount) {
+		atomic_inc(&localHistogram[sliceIndex]);
+	}
+}
+
+// A bin-range partitioned version of histogramLocal for histograms too large to fit in local memory, e.g. 65536 bins for 16-bit images.
+// The third dimension of the NDRange selects a slice of sliceBins bins, which each work group holds in local memory.
+// Every slice reads the whole channel but only counts the pixels that fall into it, then merges into its own range of the global histogram.
+// The local size must be 1 in the channel and slice dimensions.
+kernel void histogramPartitioned(global const pixel_t* inputImage, global count_t* histogram, const uint binSize, const uint numberOfBins, const uint sliceBins, const uint pixelsPerItem, const uint sampleStride, const count_t inputCount, local uint* localHistogram) {
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+	uint channel = get_global_id(1);
+	uint sliceStart = get_global_id(2) * sliceBins;
+	// The last slice may only be partially filled.
+	uint sliceCount = min(sliceBins, numberOfBins - sliceStart);
+
+	// Move to the start of this channel's pixels and this slice of its histogram.
+	inputImage += channel * inputCount;
+	histogram += channel * numberOfBins + sliceStart;
+
+	// Clear the local slice, each work item clears every Nth bin.
+	for (uint bin = lid; bin < sliceCount; bin += N) {
+		localHistogram[bin] = 0;
+	}
+
+	// Wait for the whole local slice to be cleared before counting.
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// The global size is padded up to a multiple of the local size, the extra work items start past the end of the image and read nothing.
+	count_t i = stripStart(pixelsPerItem, sampleStride);
+	count_t step = stripStep(sampleStride);
+	uint k = 0;
+	for (; k < pixelsPerItem / 8 && i + 8 <= inputCount; k++, i += step) {
+		// Get the bin indices of 8 pixels at once, this integer division is always floored toward zero.
+		uint8 binIndices = convert_uint8(vload8(0, inputImage + i)) / binSize;
+
+		countInSlice(localHistogram, binIndices.s0, sliceStart, sliceCount);
+		countInSlice(localHistogram, binIndices.s1, sliceStart, sliceCount);
+		countInSlice(localHistogram, binIndices.s2, sliceStart, sliceCount);
+		countInSlice(localHistogram, binIndices.s3, sliceStart, sliceCount);
+		countInSlice(localHistogram, binIndices.s4, sliceStart, sliceCount);
+		countInSlice(localHistogram, binIndices.s5, sliceStart, sliceCount);
+		countInSlice(localHistogram, binIndices.s6, sliceStart, sliceCount);
+		countInSlice(localHistogram, binIndices.s7, sliceStart, sliceCount);
+	}
+
+	// Ragged tail, only the work item whose next vector runs past the end of the channel has one, it is read one pixel at a time.
+	if (k < pixelsPerItem / 8) {
+		for (; i < inputCount; i++) {
+			countInSlice(localHistogram, inputImage[i] / binSize, sliceStart, sliceCount);
+		}
+	}
+
+	// Wait for the whole group to finish counting.
+	barrier(CLK_LOCAL_MEM_FENCE);
 
-	// Get the bin index, this integer division is always floored toward zero.
-	uint binIndex = inputImage[id] / binSize;
-	// Atomically increment the value at this bin index.
-	atomic_inc(&histogram[binIndex]);
+	// Merge the slice into the global histogram, skipping empty bins to save on global atomics.
+	for (uint bin = lid; bin < sliceCount; bin += N) {
+		uint count = localHistogram[bin];
+		if (count > 0) {
+			countAdd(&histogram[bin], count);
+		}
+	}
 }
 
-kernel void normaliseToLut(global const uint* inputHistogram, const uint maxValue, global uint* outputHistogram, const ushort maxPixelValue) {
+// The most bins histogramPrivate can keep in registers, must match ParallelProcessor::MaxPrivateBins.
+#define MAX_PRIVATE_BINS 32
+
+// Counts 8 bin indices into a private histogram without any atomics. Once the loop is unrolled every index into counts
+// is a compile time constant, which is what lets the compiler keep the whole array in registers.
+void countPrivate8(uint* counts, uint8 binIndices) {
+	#pragma unroll
+	for (uint bin = 0; bin < MAX_PRIVATE_BINS; bin++) {
+		// Vector comparisons give -1 in every matching lane, so subtracting the sum of the lanes adds the number of matches.
+		int8 matches = binIndices == (uint8)(bin);
+		int4 pairs = matches.lo + matches.hi;
+		int2 quads = pairs.lo + pairs.hi;
+		counts[bin] -= quads.x + quads.y;
+	}
+}
+
+// A register-resident histogram for very small bin counts, e.g. large bin sizes. Each work item counts its strip into a private
+// array with no atomics at all, then the work group sums each bin with a tree reduction in local memory and makes one global write per bin.
+// numberOfBins must be at most MAX_PRIVATE_BINS, and the local size must be a power of two and 1 in the channel dimension.
+kernel void histogramPrivate(global const pixel_t* inputImage, global count_t* histogram, const uint binSize, const uint numberOfBins, const uint pixelsPerItem, const uint sampleStride, const count_t inputCount, local uint* scratch) {
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+	uint channel = get_global_id(1);
+
+	// Move to the start of this channel's pixels and histogram.
+	inputImage += channel * inputCount;
+	histogram += channel * numberOfBins;
+
+	uint counts[MAX_PRIVATE_BINS];
+	#pragma unroll
+	for (uint bin = 0; bin < MAX_PRIVATE_BINS; bin++) {
+		counts[bin] = 0;
+	}
+
+	// The global size is padded up to a multiple of the local size, the extra work items start past the end of the image and read nothing.
+	count_t i = stripStart(pixelsPerItem, sampleStride);
+	count_t step = stripStep(sampleStride);
+	uint k = 0;
+	for (; k < pixelsPerItem / 8 && i + 8 <= inputCount; k++, i += step) {
+		// Get the bin indices of 8 pixels at once, this integer division is always floored toward zero.
+		countPrivate8(counts, convert_uint8(vload8(0, inputImage + i)) / binSize);
+	}
+
+	// Ragged tail, only the work item whose next vector runs past the end of the channel has one, it is read one pixel at a time.
+	if (k < pixelsPerItem / 8) {
+		for (; i < inputCount; i++) {
+			uint binIndex = inputImage[i] / binSize;
+			#pragma unroll
+			for (uint bin = 0; bin < MAX_PRIVATE_BINS; bin++) {
+				counts[bin] += binIndex == bin;
+			}
+		}
+	}
+
+	#pragma unroll
+	for (uint bin = 0; bin < MAX_PRIVATE_BINS; bin++) {
+		// numberOfBins is the same for the whole work group, so the barriers inside this branch are safe.
+		if (bin < numberOfBins) {
+#if defined(HAS_SUB_GROUPS)
+			// Reduce across the sub-group in registers, one global write per bin per sub-group.
+			uint total = sub_group_reduce_add(counts[bin]);
+			if (get_sub_group_local_id() == 0 && total > 0) {
+				countAdd(&histogram[bin], total);
+			}
+#elif defined(HAS_WORK_GROUP_COLLECTIVES)
+			// Reduce across the work group with the built-in, one global write per bin per work group.
+			uint total = work_group_reduce_add(counts[bin]);
+			if (lid == 0 && total > 0) {
+				countAdd(&histogram[bin], total);
+			}
+#else
+			scratch[lid] = counts[bin];
+
+			// Wait for every work item's count to be in local memory.
+			barrier(CLK_LOCAL_MEM_FENCE);
+
+			// Tree reduction, halving the number of active work items each step.
+			for (int stride = N / 2; stride > 0; stride /= 2) {
+				if (lid < stride) {
+					scratch[lid] += scratch[lid + stride];
+				}
+
+				barrier(CLK_LOCAL_MEM_FENCE);
+			}
+
+			// One global write per bin per work group.
+			if (lid == 0 && scratch[0] > 0) {
+				countAdd(&histogram[bin], scratch[0]);
+			}
+#endif
+		}
+	}
+}
+
+// Updates the histogram of the previous frame for a new frame by only visiting the tiles that changed between them, applying the logic
+// of the histogram kernels to the difference: pixels that moved bin decrement their old bin and increment their new one.
+// The first dimension of the NDRange covers the pixels of a tileSize x tileSize tile, the second selects the colour channel
+// and the third selects the dirty tile. Tiles are numbered row by row across the image.
+// previousTiles holds only the dirty tiles of the previous frame, packed tile by tile and then channel by channel.
+kernel void histogramUpdateTiles(global const pixel_t* previousTiles, global const pixel_t* currentImage, global count_t* histogram, global const uint* dirtyTiles, const uint binSize, const uint numberOfBins, const uint imageWidth, const uint imageHeight, const uint tileSize) {
+	uint tilePixel = get_global_id(0);
+	uint channel = get_global_id(1);
+	uint dirtyIndex = get_global_id(2);
+	uint tile = dirtyTiles[dirtyIndex];
+
+	// Find this pixel in the image, edge tiles may hang over the right and bottom of the image.
+	uint tilesPerRow = (imageWidth + tileSize - 1) / tileSize;
+	uint x = (tile % tilesPerRow) * tileSize + tilePixel % tileSize;
+	uint y = (tile / tilesPerRow) * tileSize + tilePixel / tileSize;
+	if (x >= imageWidth || y >= imageHeight) {
+		return;
+	}
+
+	count_t id = ((count_t)channel * imageHeight + y) * imageWidth + x;
+
+	// Get the bin indices, this integer division is always floored toward zero.
+	uint previousBin = previousTiles[((count_t)dirtyIndex * get_global_size(1) + channel) * get_global_size(0) + tilePixel] / binSize;
+	uint currentBin = currentImage[id] / binSize;
+
+	// Move the pixel between bins if it needs to, most pixels in a dirty tile usually don't.
+	if (previousBin != currentBin) {
+		histogram += channel * numberOfBins;
+		countSub(&histogram[previousBin], 1);
+		countAdd(&histogram[currentBin], 1);
+	}
+}
+
+// Normalises a batch of cumulative histograms into lookup tables, the second dimension of the NDRange selects the colour channel.
+// The histograms are scanned back to back, so each channel's counts start from the total of the channels before it.
+kernel void normaliseToLut(global const count_t* inputHistogram, global pixel_t* outputHistogram, const ushort maxPixelValue) {
 	int id = get_global_id(0);
+	int channel = get_global_id(1);
+	int numberOfBins = get_global_size(0);
+	int offset = channel * numberOfBins;
+
+	// Work out where this channel starts and its total, which is just its last value minus the start.
+	count_t channelStart = channel > 0 ? inputHistogram[offset - 1] : 0;
+	count_t maxValue = inputHistogram[offset + numberOfBins - 1] - channelStart;
 
 	// Calculate the normalised value between 0 and 1. We cast to a double to avoid integer rounding occurring.
-	double normalised = (double)inputHistogram[id] / maxValue;
+	double normalised = (double)(inputHistogram[offset + id] - channelStart) / maxValue;
 	// Scale the normalised value back up to the scale of the image.
-	uint scaled = normalised * maxPixelValue;
-	outputHistogram[id] = scaled;
+	pixel_t scaled = normalised * maxPixelValue;
+	outputHistogram[offset + id] = scaled;
 }
 
 
-kernel void backprojection(global const ushort* inputImage, global const uint* inputHistogram, global ushort* outputImage, const uint binSize) {
-	int id = get_global_id(0);
+// Maps every pixel through its channel's lookup table. Each work item maps pixelsPerItem pixels using vector loads and stores of 8, laid out as described above stripStart.
+// pixelsPerItem must be a multiple of 8, any ragged tail at the end of the channel is mapped one pixel at a time.
+// The second dimension of the NDRange selects the colour channel and its lookup table.
+kernel void backprojectionCoarse(global const pixel_t* inputImage, global const pixel_t* inputHistogram, global pixel_t* outputImage, const uint binSize, const uint numberOfBins, const uint pixelsPerItem, const count_t inputCount) {
+	uint channel = get_global_id(1);
 
-	// Get the bin index, this integer division is always floored toward zero.
-	uint binIndex = inputImage[id] / binSize;
+	// Move to the start of this channel's pixels and lookup table.
+	inputImage += channel * inputCount;
+	outputImage += channel * inputCount;
+	inputHistogram += channel * numberOfBins;
 
-	outputImage[id] = inputHistogram[binIndex];
-}
+	count_t i = stripStart(pixelsPerItem, 1);
+	count_t step = stripStep(1);
+	uint k = 0;
+	for (; k < pixelsPerItem / 8 && i + 8 <= inputCount; k++, i += step) {
+		// Get the bin indices of 8 pixels at once, this integer division is always floored toward zero.
+		uint8 binIndices = convert_uint8(vload8(0, inputImage + i)) / binSize;
+
+		pixel8_t values = (pixel8_t)(inputHistogram[binIndices.s0], inputHistogram[binIndices.s1], inputHistogram[binIndices.s2], inputHistogram[binIndices.s3],
+			inputHistogram[binIndices.s4], inputHistogram[binIndices.s5], inputHistogram[binIndices.s6], inputHistogram[binIndices.s7]);
+
+		vstore8(values, 0, outputImage + i);
+	}
+
+	// Ragged tail, only the work item whose next vector runs past the end of the channel has one, it is read one pixel at a time.
+	if (k < pixelsPerItem / 8) {
+		for (; i < inputCount; i++) {
+			outputImage[i] = inputHistogram[inputImage[i] / binSize];
+		}
+	}
+}
\ No newline at end of file
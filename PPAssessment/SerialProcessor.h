@@ -1,19 +1,25 @@
 #pragma once
 
+// PixelType is the storage type of the image, unsigned char for 8-bit images or unsigned short for 16-bit images.
+// CountType is the type of the histogram counts, a 64-bit type is only needed when an image has too many pixels for a 32-bit count.
+template <typename PixelType, typename CountType>
 class SerialProcessor {
 private:
-	CImg<unsigned short>& InputImage;
+	CImg<PixelType>& InputImage;
 	unsigned int& BinSize;
 	double& TotalDurationMs;
 	unsigned short& MaxPixelValue;
-	unsigned int ImageSize;
+	size_t ImageSize;
+	// Only every SampleStride-th pixel is counted when building the histogram, 1 counts every pixel.
+	unsigned int SampleStride;
 
-	vector<unsigned int> BuildHistogram(const vector<unsigned short>& imageColourChannelData) {
+	// Only every stride-th pixel is counted, 1 counts every pixel.
+	vector<CountType> BuildHistogram(const vector<PixelType>& imageColourChannelData, const unsigned int stride) {
 		const unsigned int numberOfBins = ceil((MaxPixelValue+1) / static_cast<float>(BinSize));
 
-		vector<unsigned int> hist(numberOfBins);
+		vector<CountType> hist(numberOfBins);
 
-		for (unsigned int i = 0; i < imageColourChannelData.size(); i++) {
+		for (size_t i = 0; i < imageColourChannelData.size(); i += stride) {
 			unsigned int binIndex = imageColourChannelData[i] / BinSize;
 			hist[binIndex]++;
 		}
@@ -21,41 +27,87 @@ private:
 		return hist;
 	}
 
-	void CumulativeSumHistogram(vector<unsigned int>& histogram) {
+	void CumulativeSumHistogram(vector<CountType>& histogram) {
 		for (unsigned int i = 1; i < histogram.size(); i++) {
 			histogram[i] += histogram[i - 1];
 		}
 	}
 
-	void NormaliseToLut(vector<unsigned int>& histogram) {
-		// Get max value (it's just the last one), cast to float so we avoid integer truncation later when dividing.
-		const float maxHistValue = static_cast<float>(histogram[histogram.size() - 1]);
+	// ScaleType is the precision of the normalisation, float here and double in the device kernel and host scan.
+	template <typename ScaleType>
+	void NormaliseToLut(vector<CountType>& histogram) {
+		// Get max value (it's just the last one), cast so we avoid integer truncation later when dividing.
+		const ScaleType maxHistValue = static_cast<ScaleType>(histogram[histogram.size() - 1]);
 
 		for (unsigned int i = 0; i < histogram.size(); i++) {
 			histogram[i] = (histogram[i] / maxHistValue) * MaxPixelValue;
 		}
 	}
 
-	void BackProject(const vector<unsigned short>& imageColourChannelData, vector<unsigned short>& outputImageData, const unsigned char& colourChannel, const vector<unsigned int>& hist) {
-		for (unsigned int i = 0; i < imageColourChannelData.size(); i++) {
+	void BackProject(const vector<PixelType>& imageColourChannelData, vector<PixelType>& outputImageData, const unsigned char& colourChannel, const vector<CountType>& hist) {
+		for (size_t i = 0; i < imageColourChannelData.size(); i++) {
 			const unsigned int binIndex = imageColourChannelData[i] / BinSize;
 			outputImageData[i + (ImageSize * colourChannel)] = hist[binIndex];
 		}
 	}
 public:
-	SerialProcessor(CImg<unsigned short>& inputImage, unsigned int& binSize, double& totalDurationMs, unsigned short& maxPixelValue, unsigned int& imageSize) :
+	SerialProcessor(CImg<PixelType>& inputImage, unsigned int& binSize, double& totalDurationMs, unsigned short& maxPixelValue, size_t& imageSize, const unsigned int sampleStride = 1) :
 		InputImage(inputImage),
 		BinSize(binSize),
 		TotalDurationMs(totalDurationMs),
 		MaxPixelValue(maxPixelValue),
-		ImageSize(imageSize) {}
+		ImageSize(imageSize),
+		SampleStride(sampleStride) {}
 
+	// Build the lookup table of every channel from every pixel, stored back to back, without any timing. Used as the reference when checking sampled histograms.
+	template <typename ScaleType>
+	vector<unsigned int> BuildLookupTables() {
+		vector<unsigned int> luts;
 
-	CImg<unsigned short> RunHistogramEqualisation() {
+		for (unsigned char colourChannel = 0; colourChannel < InputImage.spectrum(); colourChannel++) {
+			// Get this colour channel data out of the image.
+			typename CImg<PixelType>::const_iterator first = InputImage.begin() + (ImageSize * colourChannel);
+			typename CImg<PixelType>::const_iterator last = InputImage.begin() + (ImageSize * colourChannel) + ImageSize;
+			vector<PixelType> imageColourChannelData(first, last);
+
+			vector<CountType> hist = BuildHistogram(imageColourChannelData, 1);
+			CumulativeSumHistogram(hist);
+			NormaliseToLut<ScaleType>(hist);
+
+			luts.insert(luts.end(), hist.begin(), hist.end());
+		}
+
+		return luts;
+	}
+
+	// Get the largest difference between two sets of lookup tables of the same size, in pixel values.
+	static unsigned int MaxLookupTableDeviation(const vector<unsigned int>& reference, const vector<unsigned int>& other) {
+		unsigned int maxDeviation = 0;
+		for (size_t i = 0; i < reference.size(); i++) {
+			const unsigned int deviation = reference[i] > other[i] ? reference[i] - other[i] : other[i] - reference[i];
+			maxDeviation = max(maxDeviation, deviation);
+		}
+
+		return maxDeviation;
+	}
+
+	// Compare lookup tables built from a sample of the pixels against ones built from every pixel and print the largest difference, so a safe sampling stride can be chosen.
+	// The reference is normalised with the same ScaleType as the sampled tables, so only sampling shows up as a difference. This is not included in any duration.
+	template <typename ScaleType>
+	void ReportSampledLookupTableDeviation(const vector<unsigned int>& sampledLuts, const string& sampledUnit) {
+		const unsigned int maxDeviation = MaxLookupTableDeviation(BuildLookupTables<ScaleType>(), sampledLuts);
+		cout << "\tSampled 1 in " << SampleStride << " " << sampledUnit << ", max lookup table deviation from the full histogram: " << maxDeviation << " (" << (100.0 * maxDeviation / MaxPixelValue) << "%)" << endl;
+	}
+
+
+	CImg<PixelType> RunHistogramEqualisation() {
 		cout << endl << "Running serial Histogram Equalisation..." << endl;
 
 		// Allocate a vector to store the output pixels.
-		vector<unsigned short> outputImageData(InputImage.size());
+		vector<PixelType> outputImageData(InputImage.size());
+
+		// When sampling, keep every channel's lookup table to compare against the full histogram at the end.
+		vector<unsigned int> sampledLuts;
 
 		time_point<high_resolution_clock> start, end;
 		double currentDuration = 0;
@@ -63,13 +115,13 @@ public:
 			cout << "Running on colour channel " << static_cast<int>(colourChannel) << ":" << endl;
 
 			// Get this colour channel data out of the image.
-			CImg<unsigned short>::const_iterator first = InputImage.begin() + (ImageSize * colourChannel);
-			CImg<unsigned short>::const_iterator last = InputImage.begin() + (ImageSize * colourChannel) + ImageSize;
-			vector<unsigned short> imageColourChannelData(first, last);
+			typename CImg<PixelType>::const_iterator first = InputImage.begin() + (ImageSize * colourChannel);
+			typename CImg<PixelType>::const_iterator last = InputImage.begin() + (ImageSize * colourChannel) + ImageSize;
+			vector<PixelType> imageColourChannelData(first, last);
 
 			// Step one, build histogram.
 			start = high_resolution_clock::now();
-			vector<unsigned int> hist = BuildHistogram(imageColourChannelData);
+			vector<CountType> hist = BuildHistogram(imageColourChannelData, SampleStride);
 			end = high_resolution_clock::now();
 			currentDuration = duration_cast<milliseconds>(end - start).count();
 			TotalDurationMs += currentDuration;
@@ -85,12 +137,16 @@ public:
 
 			// Step three, convert to normalised lookup table.
 			start = high_resolution_clock::now();
-			NormaliseToLut(hist);
+			NormaliseToLut<float>(hist);
 			end = high_resolution_clock::now();
 			currentDuration = duration_cast<milliseconds>(end - start).count();
 			TotalDurationMs += currentDuration;
 			cout << "\tNormalise to Lookup table duration: " << currentDuration << "ms" << endl;
 
+			if (SampleStride > 1) {
+				sampledLuts.insert(sampledLuts.end(), hist.begin(), hist.end());
+			}
+
 			// Step four, backproject.
 			start = high_resolution_clock::now();
 			BackProject(imageColourChannelData, outputImageData, colourChannel, hist);
@@ -100,10 +156,14 @@ public:
 			cout << "\tBackprojection duration: " << currentDuration << "ms" << endl;
 		}
 
+		if (SampleStride > 1) {
+			ReportSampledLookupTableDeviation<float>(sampledLuts, "pixels");
+		}
+
 		cout << endl << "Total Serial Algorithm Duration: " << TotalDurationMs << "ms" << endl;
 
 		// Create the image from the output data.
-		CImg<unsigned short> outputImageSerial(outputImageData.data(), InputImage.width(), InputImage.height(), InputImage.depth(), InputImage.spectrum());
+		CImg<PixelType> outputImageSerial(outputImageData.data(), InputImage.width(), InputImage.height(), InputImage.depth(), InputImage.spectrum());
 
 		return outputImageSerial;
 	}
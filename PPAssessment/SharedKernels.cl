@@ -1,12 +1,98 @@
+// Work group collectives are core in OpenCL C 2.0 and an optional feature in 3.0, the host only builds with a newer standard when the device has one.
+// Kernels use the built-ins when they are available and fall back to their OpenCL 1.2 loops otherwise.
+#if defined(__OPENCL_C_VERSION__) && __OPENCL_C_VERSION__ >= 200 && (__OPENCL_C_VERSION__ < 300 || defined(__opencl_c_work_group_collective_functions))
+#define HAS_WORK_GROUP_COLLECTIVES
+#endif
+
+// Sub-group built-ins come from cl_khr_subgroups, or are an optional feature in OpenCL C 3.0.
+#if defined(cl_khr_subgroups)
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#define HAS_SUB_GROUPS
+#elif defined(__opencl_c_subgroups)
+#define HAS_SUB_GROUPS
+#endif
+
+// Histogram counts, scan values and pixel indices use count_t. Programs are normally built with 32-bit counts,
+// and rebuilt with -D COUNT_64 for images with too many pixels for a uint to count or index.
+#ifdef COUNT_64
+typedef ulong count_t;
+
+// Adds to a 64-bit global counter using 32-bit atomics, so it works without cl_khr_int64_base_atomics.
+// Assumes a little-endian device. The carry out of the low word is added to the high word, which is only read once the kernel has finished.
+void countAdd(global count_t* counter, uint value) {
+	global uint* words = (global uint*)counter;
+	uint old = atomic_add(&words[0], value);
+	if (old + value < old) {
+		atomic_inc(&words[1]);
+	}
+}
+
+// Subtracts from a 64-bit global counter using 32-bit atomics, borrowing from the high word when the low word wraps.
+void countSub(global count_t* counter, uint value) {
+	global uint* words = (global uint*)counter;
+	uint old = atomic_sub(&words[0], value);
+	if (old < value) {
+		atomic_dec(&words[1]);
+	}
+}
+#else
+typedef uint count_t;
+
+void countAdd(global count_t* counter, uint value) {
+	atomic_add(counter, value);
+}
+
+void countSub(global count_t* counter, uint value) {
+	atomic_sub(counter, value);
+}
+#endif
+
+// Image pixels and lookup table values use pixel_t. Programs are normally built for 16-bit images,
+// and rebuilt with -D PIXEL_8 so 8-bit images move half the bytes.
+#ifdef PIXEL_8
+typedef uchar pixel_t;
+typedef uchar8 pixel8_t;
+#else
+typedef ushort pixel_t;
+typedef ushort8 pixel8_t;
+#endif
+
+// The coarsened kernels read pixelsPerItem pixels per work item, in vectors of 8. CPU runtimes run each work item on a single thread,
+// so there every work item reads one contiguous strip. Other devices are built with -D INTERLEAVED_STRIPS, where vector k of each work item
+// follows vector k of the one before it, so neighbouring work items read neighbouring memory and their loads coalesce.
+// When sampling only 1 in sampleStride strips, or vectors when interleaved, is read.
+
+// Get the first pixel of the work item's first vector.
+count_t stripStart(uint pixelsPerItem, uint sampleStride) {
+#ifdef INTERLEAVED_STRIPS
+	return (count_t)get_global_id(0) * 8 * sampleStride;
+#else
+	return (count_t)get_global_id(0) * pixelsPerItem * sampleStride;
+#endif
+}
+
+// Get the distance in pixels from one of the work item's vectors to the next.
+count_t stripStep(uint sampleStride) {
+#ifdef INTERLEAVED_STRIPS
+	return (count_t)get_global_size(0) * 8 * sampleStride;
+#else
+	return 8;
+#endif
+}
+
 // A double-buffered version of the Hillis-Steele inclusive scan
 // Requires two additional input arguments which correspond to two local buffers
-kernel void scanHillisSteeleBuffered(global const uint* input, global uint* output, local uint* temp1, local uint* temp2) {
-	int id = get_global_id(0);
+kernel void scanHillisSteeleBuffered(global const count_t* input, global count_t* output, local count_t* temp1, local count_t* temp2) {
+#ifdef HAS_WORK_GROUP_COLLECTIVES
+	// The built-in scan does the same job as the double buffered loop.
+	output[get_global_id(0)] = work_group_scan_inclusive_add(input[get_global_id(0)]);
+#else
+	size_t id = get_global_id(0);
 	int lid = get_local_id(0);
 	int N = get_local_size(0);
 
 	// Used for buffer swap.
-	local uint* tempHolder;
+	local count_t* tempHolder;
 
 	// Cache all N values from global memory to local memory.
 	temp1[lid] = input[id];
@@ -34,32 +120,211 @@ kernel void scanHillisSteeleBuffered(global const uint* input, global uint* outp
 
 	// Copy the cache to output array.
 	output[id] = temp1[lid];
+#endif
 }
 
 // Calculates the block sums.
-kernel void blockSum(global const uint* input, global uint* output, const uint localSize) {
-	int id = get_global_id(0);
+kernel void blockSum(global const count_t* input, global count_t* output, const uint localSize) {
+	size_t id = get_global_id(0);
 	output[id] = input[(id + 1) * localSize - 1];
 }
 
-// Adjust the values stored in partial scans by adding block sums to corresponding blocks.
-kernel void scanAddAdjust(global uint* partialScanResult, global const uint* blockSums) {
-	int id = get_global_id(0);
-	int gid = get_group_id(0);
-	partialScanResult[id] += blockSums[gid];
+// Adjust the values stored in partial scans by adding the scanned block sums to every block after the first.
+// The range starts one block in, so block n gets the total of all the blocks before it.
+kernel void scanAddAdjust(global count_t* partialScanResult, global const count_t* blockSums, const uint blockSize) {
+	size_t id = get_global_id(0);
+	partialScanResult[id] += blockSums[id / blockSize - 1];
 }
 
-kernel void scanHillisSteele(global uint* inputHistogram) {
-	int id = get_global_id(0);
-	int N = get_global_size(0);
+// Blelloch scans pad local memory with one extra slot every NUM_BANKS elements so the tree's strided accesses land in different banks.
+#define LOG_NUM_BANKS 5
+#define CONFLICT_FREE_INDEX(n) ((n) + ((n) >> LOG_NUM_BANKS))
 
-	for (int stride = 1; stride < N; stride *= 2) {
-		if (id >= stride)
-		{
-			inputHistogram[id] += inputHistogram[id - stride];
+// Work efficient up-sweep/down-sweep scan, each work group scans a block of twice its local size with O(n) additions.
+// The local size must be a power of two and temp must hold CONFLICT_FREE_INDEX(2 * local size) elements.
+// The result is made inclusive so it pairs with blockSum and scanAddAdjust the same way as scanHillisSteeleBuffered.
+kernel void scanBlelloch(global const count_t* input, global count_t* output, local count_t* temp) {
+	size_t blockStart = get_group_id(0) * get_local_size(0) * 2;
+	int lid = get_local_id(0);
+	int N = get_local_size(0) * 2;
+
+	// Each work item loads two elements half a block apart, so neighbouring work items read neighbouring addresses.
+	int ai = lid;
+	int bi = lid + N / 2;
+	count_t a = input[blockStart + ai];
+	count_t b = input[blockStart + bi];
+	temp[CONFLICT_FREE_INDEX(ai)] = a;
+	temp[CONFLICT_FREE_INDEX(bi)] = b;
+
+	// Up-sweep, build the partial sums up the tree in place.
+	int offset = 1;
+	for (int d = N / 2; d > 0; d /= 2) {
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < d) {
+			int left = offset * (2 * lid + 1) - 1;
+			int right = offset * (2 * lid + 2) - 1;
+			temp[CONFLICT_FREE_INDEX(right)] += temp[CONFLICT_FREE_INDEX(left)];
+		}
+		offset *= 2;
+	}
+
+	// Clear the root then down-sweep, pushing the sums back down the tree to leave an exclusive scan.
+	if (lid == 0) {
+		temp[CONFLICT_FREE_INDEX(N - 1)] = 0;
+	}
+	for (int d = 1; d < N; d *= 2) {
+		offset /= 2;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < d) {
+			int left = offset * (2 * lid + 1) - 1;
+			int right = offset * (2 * lid + 2) - 1;
+			count_t t = temp[CONFLICT_FREE_INDEX(left)];
+			temp[CONFLICT_FREE_INDEX(left)] = temp[CONFLICT_FREE_INDEX(right)];
+			temp[CONFLICT_FREE_INDEX(right)] += t;
+		}
+	}
+
+	// Wait for the down-sweep to finish.
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Add each element back on to make the scan inclusive.
+	output[blockStart + ai] = temp[CONFLICT_FREE_INDEX(ai)] + a;
+	output[blockStart + bi] = temp[CONFLICT_FREE_INDEX(bi)] + b;
+}
+
+// The number of consecutive elements each work item of scanSingleGroup scans by itself.
+#define SCAN_ITEMS_PER_THREAD 8
+
+// Scans an array small enough for a single work group in one launch, with no block sums and nothing left in global memory between steps.
+// Each work item scans a run of SCAN_ITEMS_PER_THREAD elements in registers, the run totals are scanned in local memory
+// and then added back to each run. totals must hold one element per work item and the local size must cover the whole array.
+kernel void scanSingleGroup(global const count_t* input, global count_t* output, const uint count, local count_t* totals) {
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+	uint start = lid * SCAN_ITEMS_PER_THREAD;
+
+	// Scan this work item's run, anything past the end of the input counts as zero.
+	count_t items[SCAN_ITEMS_PER_THREAD];
+	count_t sum = 0;
+	for (int i = 0; i < SCAN_ITEMS_PER_THREAD; i++) {
+		if (start + i < count) {
+			sum += input[start + i];
+		}
+		items[i] = sum;
+	}
+
+#ifdef HAS_WORK_GROUP_COLLECTIVES
+	// The built-in gives the total of every earlier run directly.
+	count_t prefix = work_group_scan_exclusive_add(sum);
+#else
+	totals[lid] = sum;
+
+	// Wait for all the run totals.
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Inclusive scan of the run totals.
+	for (int offset = 1; offset < N; offset *= 2) {
+		count_t value = lid >= offset ? totals[lid - offset] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		totals[lid] += value;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	// The total of every earlier run.
+	count_t prefix = lid > 0 ? totals[lid - 1] : 0;
+#endif
+
+	// Add the earlier runs to this one.
+	for (int i = 0; i < SCAN_ITEMS_PER_THREAD; i++) {
+		if (start + i < count) {
+			output[start + i] = items[i] + prefix;
+		}
+	}
+}
+
+// Tile states for scanDecoupledLookback.
+#define TILE_PENDING 0
+#define TILE_AGGREGATE 1
+#define TILE_PREFIX 2
+
+// Single pass scan with decoupled look-back. Each work group scans one tile of local size elements, publishes the tile's total
+// and then walks back over the earlier tiles, adding their totals until it finds one that already knows its full prefix.
+// tileStatus[0] hands out tile numbers in the order work groups start, so a tile only ever waits on tiles that are already running.
+// The rest of tileStatus holds one state per tile and must start at zero, tileValues holds the tile totals followed by the tile prefixes.
+kernel void scanDecoupledLookback(global const count_t* input, global count_t* output, const count_t count, volatile global uint* tileStatus, volatile global count_t* tileValues, local count_t* temp) {
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+	uint tileCount = get_num_groups(0);
+	volatile global uint* tileStates = tileStatus + 1;
+	local uint tile;
+	local count_t exclusivePrefix;
+
+	// Take the next tile number.
+	if (lid == 0) {
+		tile = atomic_inc(&tileStatus[0]);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Load the tile, anything past the end of the input counts as zero.
+	size_t id = (size_t)tile * N + lid;
+#ifdef HAS_WORK_GROUP_COLLECTIVES
+	// Inclusive scan of the tile with the built-in, the total is still read from local memory below.
+	temp[lid] = work_group_scan_inclusive_add(id < count ? input[id] : 0);
+	barrier(CLK_LOCAL_MEM_FENCE);
+#else
+	temp[lid] = id < count ? input[id] : 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Inclusive scan of the tile in local memory.
+	for (int offset = 1; offset < N; offset *= 2) {
+		count_t value = lid >= offset ? temp[lid - offset] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		temp[lid] += value;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+#endif
+
+	if (lid == 0) {
+		count_t aggregate = temp[N - 1];
+		count_t prefix = 0;
+
+		if (tile == 0) {
+			// The first tile's prefix is just its own total.
+			tileValues[tileCount] = aggregate;
+			write_mem_fence(CLK_GLOBAL_MEM_FENCE);
+			atomic_xchg(&tileStates[0], TILE_PREFIX);
 		}
+		else {
+			// Publish the total straight away so later tiles don't have to wait for the look-back.
+			tileValues[tile] = aggregate;
+			write_mem_fence(CLK_GLOBAL_MEM_FENCE);
+			atomic_xchg(&tileStates[tile], TILE_AGGREGATE);
+
+			// Look back until a tile with a full prefix is found.
+			for (int previous = tile - 1; previous >= 0; previous--) {
+				uint state;
+				do {
+					state = atomic_or(&tileStates[previous], 0);
+				} while (state == TILE_PENDING);
+				read_mem_fence(CLK_GLOBAL_MEM_FENCE);
+
+				if (state == TILE_PREFIX) {
+					prefix += tileValues[tileCount + previous];
+					break;
+				}
+				prefix += tileValues[previous];
+			}
+
+			tileValues[tileCount + tile] = prefix + aggregate;
+			write_mem_fence(CLK_GLOBAL_MEM_FENCE);
+			atomic_xchg(&tileStates[tile], TILE_PREFIX);
+		}
+		exclusivePrefix = prefix;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
 
-		// Sync the step.
-		barrier(CLK_GLOBAL_MEM_FENCE);
+	// Write the tile out with the total of every tile before it.
+	if (id < count) {
+		output[id] = temp[lid] + exclusivePrefix;
 	}
 }
\ No newline at end of file
@@ -2,139 +2,632 @@
 
 class SharedParallel {
 public:
-	static vector<unsigned int> CumulativeSumParallel(const cl::Program& program, const cl::Context& context, const cl::CommandQueue& queue, const int deviceId, vector<unsigned int> input, double& totalDurationMs) {
-		// Save the size and count of the input for use with the output later. We need to do this first before any padding is added to the input.
-		const size_t outputCount = input.size();
-		const size_t outputSize = outputCount * sizeof(unsigned int);
+	// Check whether each work item of a coarsened kernel should read one contiguous strip on this device. CPU runtimes run a work item
+	// on a single thread so a strip stays in its cache, everywhere else neighbouring work items run together and the kernels
+	// are built with INTERLEAVED_STRIPS so their loads coalesce.
+	static bool UsesContiguousStrips(const cl::Device& device) {
+		return (device.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU) != 0;
+	}
 
-		cout << "\tTwo-Stage Scan for Large Arrays:" << endl;
+	// Choose how many pixels each work item of a coarsened kernel should process on this device.
+	// The result is always a multiple of 8 so the kernels can use vector loads.
+	static unsigned int GetPixelsPerWorkItem(const cl::Device& device, const size_t pixelCount) {
+		// CPU runtimes map work items onto a handful of threads so they want long strips, GPUs need many more work items in flight to hide memory latency.
+		const size_t workItemsPerComputeUnit = UsesContiguousStrips(device) ? 64 : 2048;
+		const size_t targetWorkItems = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * workItemsPerComputeUnit;
 
-		// Create the kernel for the double buffered scan.
-		cl::Kernel phase1Kernel = cl::Kernel(program, "scanHillisSteeleBuffered");
+		// Spread the pixels across the target number of work items, rounded up to a whole number of vector loads.
+		size_t pixelsPerItem = (pixelCount + targetWorkItems - 1) / targetWorkItems;
+		pixelsPerItem = ((pixelsPerItem + 7) / 8) * 8;
 
-		// Get the device so we can extract info about it.
-		const cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[deviceId];
+		// Keep at least one vector load per work item, and cap the strip length so small devices still get some parallelism.
+		return static_cast<unsigned int>(max<size_t>(8, min<size_t>(pixelsPerItem, 1024)));
+	}
 
-		// Get the preferred local size.
-		const size_t localSize = phase1Kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
-		// Calculate how many bytes this is.
-		const size_t localSizeBytes = localSize * sizeof(unsigned int);
+	// The scan used by CumulativeSumParallel. Auto scans arrays that fit in a single work group in one launch, uses Hillis-Steele when
+	// the array fits in a single block, where it takes fewer steps, and the work efficient Blelloch scan for anything bigger.
+	// Both of these run as a multi-level scan.
+	// Single pass scans the whole array in one launch with decoupled look-back instead.
+	// Compare runs all of them and reports their times, keeping the Blelloch result.
+	enum ScanAlgorithm {
+		SCAN_AUTO,
+		SCAN_HILLIS_STEELE,
+		SCAN_BLELLOCH,
+		SCAN_SINGLE_PASS,
+		SCAN_COMPARE
+	};
+
+	// A command queue of its own with a pool of its own, so its commands can run alongside those on other lanes.
+	// Buffers from the pool are only ever used on the lane's queue, which keeps reusing them safe without waiting across queues.
+	struct QueueLane {
+		cl::CommandQueue Queue;
+		BufferPool Pool;
+
+		QueueLane(const cl::Context& context, const cl::Device& device) : Queue(context, device, CL_QUEUE_PROFILING_ENABLE), Pool(context) {}
+	};
+
+	// The cost of running a step on the host and on the device, each a fixed cost plus a cost per element fitted from timings of two array sizes.
+	struct DispatchCosts {
+		double HostFixedUs = 0;
+		double HostPerElementUs = 0;
+		double DeviceFixedUs = 0;
+		double DevicePerElementUs = 0;
+
+		// Check whether the host is predicted to be faster for an array of this many elements.
+		bool PreferHost(const size_t count) const {
+			return HostFixedUs + HostPerElementUs * count < DeviceFixedUs + DevicePerElementUs * count;
+		}
+	};
+
+	// The dispatch costs of a device for the scan of an array on the host, and for the scan and normalisation to lookup tables of histograms already on the device.
+	// Each is end to end, so the host side of the second includes copying the histograms back and the lookup tables out again.
+	struct DispatchModel {
+		DispatchCosts Scan;
+		DispatchCosts ScanAndNormalise;
+	};
+
+	// The commands queued for an image in the order they were queued, each named for the profiling report.
+	typedef vector<pair<string, cl::Event>> EventList;
+
+	// The wait list for the next command, the last one queued. Every command waits on the one before it,
+	// so the host only ever has to wait for the end of the chain.
+	static vector<cl::Event> After(const EventList& events) {
+		return events.empty() ? vector<cl::Event>() : vector<cl::Event>(1, events.back().second);
+	}
 
-		// Work out if we need any padding.
-		const size_t paddingSize = input.size() % localSize;
+	// The device time the first of the events started and the last of them ended, they must all have finished.
+	static void GetTimeline(const EventList& events, cl_ulong& start, cl_ulong& end) {
+		start = numeric_limits<cl_ulong>::max();
+		end = 0;
+		for (const pair<string, cl::Event>& event : events) {
+			start = min(start, event.second.getProfilingInfo<CL_PROFILING_COMMAND_START>());
+			end = max(end, event.second.getProfilingInfo<CL_PROFILING_COMMAND_END>());
+		}
+	}
 
-		// Do we need padding?
-		if (paddingSize > 0) {
-			// Yes, add the appropriate number of zeros as padding. Zeros are used because they don't affect the sum.
-			const vector<unsigned int> paddingVector(localSize - paddingSize, 0);
-			input.insert(input.end(), paddingVector.begin(), paddingVector.end());
+	// Check whether a command moves data between the host and the device rather than running on the device.
+	static bool IsHostTransfer(const cl_command_type type) {
+		switch (type) {
+		case CL_COMMAND_READ_BUFFER:
+		case CL_COMMAND_WRITE_BUFFER:
+		case CL_COMMAND_READ_BUFFER_RECT:
+		case CL_COMMAND_WRITE_BUFFER_RECT:
+		case CL_COMMAND_MAP_BUFFER:
+		case CL_COMMAND_UNMAP_MEM_OBJECT:
+			return true;
+		default:
+			return false;
 		}
+	}
 
-		// How many elements do we have now?
-		const size_t inputCount = input.size();
+	// Wait for the last of the events, then print them all. This is where the host waits for the device.
+	// Kernels and copies on the device add their execution time to the total, copies to and from the host and maps are shown but not counted.
+	// The timeline line compares the time from the first command starting to the last finishing with the time spent running commands,
+	// the second is larger when commands overlapped.
+	static void ReportEvents(const EventList& events, double& totalDurationMs) {
+		if (events.empty()) {
+			return;
+		}
+		events.back().second.wait();
 
-		// What's the memory footprint of the input?
-		const size_t inputSize = input.size() * sizeof(unsigned int);
+		double busyMs = 0;
+		for (const pair<string, cl::Event>& event : events) {
+			cout << "\t" << event.first << ": " << GetFullProfilingInfo(event.second, ProfilingResolution::PROF_US) << endl;
 
-		// How many work groups need to run?
-		const size_t numberOfGroups = inputCount / localSize;
+			const double executionMs = GetProfilingExecutionTimeMs(event.second);
+			if (!IsHostTransfer(event.second.getInfo<CL_EVENT_COMMAND_TYPE>())) {
+				totalDurationMs += executionMs;
+			}
 
-		// What's the memory footprint of this many work groups?
-		const size_t numberOfGroupsBytes = numberOfGroups * sizeof(unsigned int);
+			busyMs += executionMs;
+		}
 
-		// Create a buffer to store the input data.
-		const cl::Buffer inputBuffer(context, CL_MEM_READ_ONLY, inputSize);
+		cl_ulong firstStart, lastEnd;
+		GetTimeline(events, firstStart, lastEnd);
+		const double timelineMs = (lastEnd - firstStart) / static_cast<double>(ProfilingResolution::PROF_MS);
+		cout << "\tDevice Timeline: " << events.size() << " commands, " << timelineMs << "ms from first start to last end, " << busyMs << "ms executing" << endl;
+	}
 
-		// Create a buffer to store the output data.
-		const cl::Buffer outputBuffer(context, CL_MEM_READ_WRITE, outputSize);
+	// Check whether buffers totalling totalBytes, the largest of them largestBytes, can all be on the device at once.
+	static bool FitsOnDevice(const cl::Device& device, const size_t largestBytes, const size_t totalBytes) {
+		return largestBytes <= device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() && totalBytes <= device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+	}
 
-		// Write the input data to the device.
-		queue.enqueueWriteBuffer(inputBuffer, CL_TRUE, 0, inputSize, &input[0]);
-		// Fill the output buffer with zeros on the device.
-		queue.enqueueFillBuffer(outputBuffer, 0, 0, outputSize);
+	// Get the most rows of an image a band can hold, for images processed a band at a time. A row takes bandBytesPerRow in all the band buffers together
+	// and largestBytesPerRow in the largest of them. The band buffers together use at most a sixteenth of the device's memory and each must fit in a single allocation.
+	// Returns 0 when not even a single row fits, the image is too wide to process on this device.
+	static size_t GetBandRows(const cl::Device& device, const size_t height, const size_t bandBytesPerRow, const size_t largestBytesPerRow) {
+		const cl_ulong rowsInMemory = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>() / 16 / bandBytesPerRow;
+		const cl_ulong rowsInAllocation = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() / largestBytesPerRow;
+		return min<size_t>(height, static_cast<size_t>(min(rowsInMemory, rowsInAllocation)));
+	}
 
-		// Set arguments for the scan kernel.
-		phase1Kernel.setArg(0, inputBuffer);
-		phase1Kernel.setArg(1, outputBuffer);
-		phase1Kernel.setArg(2, cl::Local(localSizeBytes));
-		phase1Kernel.setArg(3, cl::Local(localSizeBytes));
+	// Queue a copy of rows of every channel of a planar image to or from a band buffer, without blocking. The image's channels are planeBytes apart.
+	// The band holds its rows of each channel back to back, so its channels are rows x rowBytes apart like a small image of its own.
+	static void EnqueueBandCopy(const cl::CommandQueue& queue, const bool toDevice, const cl::Buffer& bandBuffer, void* image, const size_t rowBytes, const size_t planeBytes, const unsigned int channels, const size_t firstRow, const size_t rows, const vector<cl::Event>& waitList, cl::Event& event) {
+		const cl::array<cl::size_type, 3> bufferOffset = { 0, 0, 0 };
+		const cl::array<cl::size_type, 3> hostOffset = { 0, firstRow, 0 };
+		const cl::array<cl::size_type, 3> region = { rowBytes, rows, channels };
 
-		// Create  an event for performance tracking.
-		cl::Event perfEventPhase1;
+		if (toDevice) {
+			queue.enqueueWriteBufferRect(bandBuffer, CL_FALSE, bufferOffset, hostOffset, region, rowBytes, rows * rowBytes, rowBytes, planeBytes, image, &waitList, &event);
+		}
+		else {
+			queue.enqueueReadBufferRect(bandBuffer, CL_FALSE, bufferOffset, hostOffset, region, rowBytes, rows * rowBytes, rowBytes, planeBytes, image, &waitList, &event);
+		}
+	}
 
-		// Run the double buffered scan kernel. Keep the result on device for now so we can re-use the buffer.
-		queue.enqueueNDRangeKernel(phase1Kernel, cl::NullRange, cl::NDRange(inputCount), cl::NDRange(localSize), NULL, &perfEventPhase1);
+	// CountType must match count_t in the kernels the program was built with - cl_uint normally, or cl_ulong with -D COUNT_64.
+	// Scans a host array by copying it to the device and back, see CumulativeSumBuffer for data that is already on the device.
+	// With a dispatch model and the automatic algorithm, arrays too small to be worth the trip to the device are scanned on the host.
+	template <typename CountType>
+	static vector<CountType> CumulativeSumParallel(KernelRegistry& kernels, BufferPool& pool, const cl::CommandQueue& queue, const vector<CountType>& input, double& totalDurationMs, const ScanAlgorithm algorithm = SCAN_AUTO, const DispatchModel* dispatchModel = nullptr) {
+		if (algorithm == SCAN_AUTO && dispatchModel != nullptr && dispatchModel->Scan.PreferHost(input.size())) {
+			high_resolution_clock::time_point start = high_resolution_clock::now();
+			vector<CountType> outputData(input.size());
+			partial_sum(input.begin(), input.end(), outputData.begin());
+			const double durationUs = duration<double, micro>(high_resolution_clock::now() - start).count();
+
+			totalDurationMs += durationUs / 1000;
+			cout << "\tHost Scan (cheaper than the device for " << input.size() << " elements): " << durationUs << " [us]" << endl;
+			return outputData;
+		}
 
-		// Create the block sum kernel for phase 2.
-		cl::Kernel phase2Kernel = cl::Kernel(program, "blockSum");
+		const size_t size = input.size() * sizeof(CountType);
 
-		// Create a separate output buffer that will store the block sum result.
-		// This buffer needs to be the same size as the number of groups.
-		const cl::Buffer phase2OutputBuffer(context, CL_MEM_READ_WRITE, numberOfGroupsBytes);
+		// Borrow buffers for the input and output.
+		const PooledBuffer inputBuffer = pool.Acquire(size);
+		const PooledBuffer outputBuffer = pool.Acquire(size);
 
-		// Set the arguments for the block sum kernel.
-		phase2Kernel.setArg(0, outputBuffer);
-		phase2Kernel.setArg(1, phase2OutputBuffer);
-		// The kernel needs to know the local size of the previous scan kernel - cast it to an int because size_t is not compatible with the kernel code.
-		phase2Kernel.setArg(2, static_cast<int>(localSize));
+		// Write the input data to the device, the input vector outlives the read below so this doesn't need to block.
+		EventList events;
+		cl::Event writeEvent;
+		queue.enqueueWriteBuffer(inputBuffer, CL_FALSE, 0, size, &input[0], NULL, &writeEvent);
+		events.push_back(make_pair(string("Write Input"), writeEvent));
 
-		// Create  an event for performance tracking.
-		cl::Event perfEventPhase2;
+		CumulativeSumBuffer<CountType>(kernels, pool, queue, inputBuffer, outputBuffer, input.size(), events, algorithm);
 
-		// Run the block sum kernel.
-		queue.enqueueNDRangeKernel(phase2Kernel, cl::NullRange, cl::NDRange(numberOfGroups), cl::NullRange, NULL, &perfEventPhase2);
+		// Copy the result back to the host once the scan is done.
+		vector<CountType> outputData(input.size());
+		const vector<cl::Event> readWaitList = After(events);
+		cl::Event readEvent;
+		queue.enqueueReadBuffer(outputBuffer, CL_TRUE, 0, size, &outputData[0], &readWaitList, &readEvent);
+		events.push_back(make_pair(string("Read Output"), readEvent));
 
-		// Create the kernel for the scan on the block sums.
-		// We use standard Hillis-Steele here because it is approximately twice as fast as a serial scan with atomics (5us vs 10us).
-		// Although Hillis-Steele is an inclusive scan we can immitate an exclusive scan by skipping the first and last items later when we run the scanAddAdjust kernel.
-		cl::Kernel phase2ScanKernel = cl::Kernel(program, "scanHillisSteele");
+		// Print out the performance values.
+		ReportEvents(events, totalDurationMs);
 
-		// Set the arguments for the block scan.
-		phase2ScanKernel.setArg(0, phase2OutputBuffer);
+		return outputData;
+	}
 
-		// Create  an event for performance tracking.
-		cl::Event perfEventPhase2Scan;
+	// Scan count elements of a device buffer into another without copying anything to or from the host, so the result can go straight on to the next kernel.
+	// The scan waits on the last of the events and its commands are added to them, nothing waits for it to finish.
+	// The input is left unchanged. Compare is the exception, it waits for every scan so it can read the results back and check they agree.
+	template <typename CountType>
+	static void CumulativeSumBuffer(KernelRegistry& kernels, BufferPool& pool, const cl::CommandQueue& queue, const cl::Buffer& input, const cl::Buffer& output, const size_t count, EventList& events, const ScanAlgorithm algorithm = SCAN_AUTO) {
+		if (algorithm == SCAN_COMPARE) {
+			// Run every scan on the same input once it is ready, only the Blelloch scan is added to the events and counts towards the total.
+			if (!events.empty()) {
+				events.back().second.wait();
+			}
+
+			const size_t size = count * sizeof(CountType);
+			const PooledBuffer compareBuffer = pool.Acquire(size);
+			double hillisSteeleDurationMs = 0;
+			double blellochDurationMs = 0;
+			double singlePassDurationMs = 0;
+
+			EventList hillisSteeleEvents;
+			Scan<CountType>(kernels, pool, queue, input, compareBuffer, count, SCAN_HILLIS_STEELE, hillisSteeleEvents);
+			const vector<CountType> hillisSteeleOutput = ReadBuffer<CountType>(queue, compareBuffer, count, hillisSteeleEvents);
+			ReportEvents(hillisSteeleEvents, hillisSteeleDurationMs);
+
+			EventList singlePassEvents;
+			ScanSinglePass<CountType>(kernels, pool, queue, input, compareBuffer, count, singlePassEvents);
+			const vector<CountType> singlePassOutput = ReadBuffer<CountType>(queue, compareBuffer, count, singlePassEvents);
+			ReportEvents(singlePassEvents, singlePassDurationMs);
+
+			const size_t firstBlellochEvent = events.size();
+			Scan<CountType>(kernels, pool, queue, input, output, count, SCAN_BLELLOCH, events);
+			const vector<CountType> blellochOutput = ReadBuffer<CountType>(queue, output, count, events);
+			for (size_t i = firstBlellochEvent; i < events.size(); i++) {
+				blellochDurationMs += GetProfilingExecutionTimeMs(events[i].second);
+			}
+
+			// Small arrays can also be scanned by a single work group.
+			if (FitsSingleGroup(kernels, count)) {
+				double singleGroupDurationMs = 0;
+				EventList singleGroupEvents;
+				ScanSingleGroup<CountType>(kernels, queue, input, compareBuffer, count, singleGroupEvents);
+				const vector<CountType> singleGroupOutput = ReadBuffer<CountType>(queue, compareBuffer, count, singleGroupEvents);
+				ReportEvents(singleGroupEvents, singleGroupDurationMs);
+				cout << "\tSingle Group Scan: " << singleGroupDurationMs << "ms" << (singleGroupOutput == blellochOutput ? "" : " - RESULTS DIFFER") << endl;
+			}
+
+			cout << "\tScan Comparison: Hillis-Steele " << hillisSteeleDurationMs << "ms, Blelloch " << blellochDurationMs << "ms, Single Pass " << singlePassDurationMs << "ms"
+				<< (hillisSteeleOutput == blellochOutput && singlePassOutput == blellochOutput ? "" : " - RESULTS DIFFER") << endl;
+			return;
+		}
+
+		if (algorithm == SCAN_SINGLE_PASS) {
+			ScanSinglePass<CountType>(kernels, pool, queue, input, output, count, events);
+			return;
+		}
+
+		ScanAlgorithm chosenAlgorithm = algorithm;
+		if (chosenAlgorithm == SCAN_AUTO) {
+			// Most histograms are small enough to scan in a single launch, which saves the block sum stage and its extra buffers.
+			if (FitsSingleGroup(kernels, count)) {
+				ScanSingleGroup<CountType>(kernels, queue, input, output, count, events);
+				return;
+			}
+
+			chosenAlgorithm = count > kernels.GetPowerOfTwoLocalSize("scanHillisSteeleBuffered") ? SCAN_BLELLOCH : SCAN_HILLIS_STEELE;
+		}
+
+		Scan<CountType>(kernels, pool, queue, input, output, count, chosenAlgorithm, events);
+	}
+
+	// Scan histograms already on the device and normalise them to lookup tables on the host, for when that is cheaper than launching kernels.
+	// Channels are stored back to back and scanned separately, each table is scaled from 0 to maxLutValue.
+	// LutType is the type of the table, pixels for RGB to match normaliseToLut or float luminance to match normaliseToLutHsl, so either gives the same tables.
+	// The host has to wait for the histograms here, the write of the tables is added to the events.
+	template <typename CountType, typename LutType>
+	static void ScanAndNormaliseOnHost(const cl::CommandQueue& queue, const cl::Buffer& histogramBuffer, const cl::Buffer& lutBuffer, const unsigned int numberOfBins, const unsigned int channels, const unsigned short maxLutValue, EventList& events) {
+		vector<CountType> histogram = ReadBuffer<CountType>(queue, histogramBuffer, static_cast<size_t>(numberOfBins) * channels, events);
+		vector<LutType> lut(histogram.size());
+
+		for (unsigned int c = 0; c < channels; c++) {
+			const typename vector<CountType>::iterator channelStart = histogram.begin() + static_cast<size_t>(c) * numberOfBins;
+			partial_sum(channelStart, channelStart + numberOfBins, channelStart);
+
+			const double maxValue = static_cast<double>(*(channelStart + numberOfBins - 1));
+			for (unsigned int bin = 0; bin < numberOfBins; bin++) {
+				lut[static_cast<size_t>(c) * numberOfBins + bin] = static_cast<LutType>(channelStart[bin] / maxValue * maxLutValue);
+			}
+		}
+
+		// The tables are a local, so this write has to block.
+		cl::Event writeEvent;
+		queue.enqueueWriteBuffer(lutBuffer, CL_TRUE, 0, lut.size() * sizeof(LutType), &lut[0], NULL, &writeEvent);
+		events.push_back(make_pair(string("Write Lookup Tables"), writeEvent));
+	}
+
+	// Get the dispatch model for the device from the cache file, calibrating and saving it the first time the device is seen.
+	// Entries are keyed by device and driver, so a driver update is recalibrated. The program must be built with 32-bit counts and 16-bit pixels.
+	static DispatchModel LoadDispatchModel(KernelRegistry& kernels, BufferPool& pool, const cl::CommandQueue& queue, const string& cacheFile) {
+		const cl::Device& device = kernels.GetDevice();
+		const string key = device.getInfo<CL_DEVICE_NAME>() + " / " + device.getInfo<CL_DRIVER_VERSION>();
+
+		// Each line is the key followed by a tab and the eight costs.
+		ifstream cacheIn(cacheFile);
+		string line;
+		while (getline(cacheIn, line)) {
+			const size_t tab = line.find('\t');
+			if (tab != string::npos && line.substr(0, tab) == key) {
+				DispatchModel model;
+				istringstream costs(line.substr(tab + 1));
+				if (costs >> model.Scan.HostFixedUs >> model.Scan.HostPerElementUs >> model.Scan.DeviceFixedUs >> model.Scan.DevicePerElementUs
+					>> model.ScanAndNormalise.HostFixedUs >> model.ScanAndNormalise.HostPerElementUs >> model.ScanAndNormalise.DeviceFixedUs >> model.ScanAndNormalise.DevicePerElementUs) {
+					cout << "Loaded host/device dispatch costs from " << cacheFile << endl;
+					return model;
+				}
+			}
+		}
+		cacheIn.close();
+
+		cout << "Calibrating host/device dispatch costs..." << endl;
+		const DispatchModel model = CalibrateDispatchModel(kernels, pool, queue);
+
+		ofstream cacheOut(cacheFile, ios::app);
+		cacheOut << key << '\t' << model.Scan.HostFixedUs << ' ' << model.Scan.HostPerElementUs << ' ' << model.Scan.DeviceFixedUs << ' ' << model.Scan.DevicePerElementUs
+			<< ' ' << model.ScanAndNormalise.HostFixedUs << ' ' << model.ScanAndNormalise.HostPerElementUs << ' ' << model.ScanAndNormalise.DeviceFixedUs << ' ' << model.ScanAndNormalise.DevicePerElementUs << endl;
+
+		return model;
+	}
+
+private:
+	// The two array sizes the dispatch model is fitted from, a small histogram and all three channels of a 16-bit one.
+	static const size_t CalibrationSmallCount = 256;
+	static const size_t CalibrationLargeCount = 3 * 65536;
+	// Each timing is the best of this many runs, so one-off stalls don't skew the model.
+	static const unsigned int CalibrationRuns = 5;
+
+	// Sends cout to another buffer while it is in scope, restoring it even when an exception is thrown. The buffer must outlive it.
+	class CoutRedirect {
+	public:
+		explicit CoutRedirect(streambuf* buffer) : OriginalBuffer(cout.rdbuf(buffer)) {}
+		~CoutRedirect() { cout.rdbuf(OriginalBuffer); }
+
+		CoutRedirect(const CoutRedirect&) = delete;
+		CoutRedirect& operator=(const CoutRedirect&) = delete;
+
+	private:
+		streambuf* OriginalBuffer;
+	};
+
+	// Time each way of running both steps at the two calibration sizes and fit a line through them.
+	static DispatchModel CalibrateDispatchModel(KernelRegistry& kernels, BufferPool& pool, const cl::CommandQueue& queue) {
+		// The device paths print their profiling info, which isn't wanted here. The guard puts cout back however calibration ends.
+		ostringstream discardedOutput;
+		const CoutRedirect redirect(discardedOutput.rdbuf());
+
+		const size_t counts[2] = { CalibrationSmallCount, CalibrationLargeCount };
+		double scanHostUs[2], scanDeviceUs[2], normaliseHostUs[2], normaliseDeviceUs[2];
+
+		for (unsigned int i = 0; i < 2; i++) {
+			const size_t count = counts[i];
+			const vector<cl_uint> histogram(count, 1);
+			const cl::Buffer histogramBuffer(pool.GetContext(), CL_MEM_READ_WRITE, count * sizeof(cl_uint));
+			const cl::Buffer cumulativeBuffer(pool.GetContext(), CL_MEM_READ_WRITE, count * sizeof(cl_uint));
+			const cl::Buffer lutBuffer(pool.GetContext(), CL_MEM_READ_WRITE, count * sizeof(cl_ushort));
+			queue.enqueueWriteBuffer(histogramBuffer, CL_TRUE, 0, count * sizeof(cl_uint), &histogram[0]);
+
+			cl::Kernel& lutKernel = kernels.Get("normaliseToLut");
+			lutKernel.setArg(0, cumulativeBuffer);
+			lutKernel.setArg(1, lutBuffer);
+			lutKernel.setArg(2, static_cast<cl_ushort>(65535));
+
+			scanHostUs[i] = scanDeviceUs[i] = normaliseHostUs[i] = normaliseDeviceUs[i] = numeric_limits<double>::max();
+			for (unsigned int run = 0; run < CalibrationRuns; run++) {
+				double ignoredDurationMs = 0;
+
+				high_resolution_clock::time_point start = high_resolution_clock::now();
+				vector<cl_uint> scanned(count);
+				partial_sum(histogram.begin(), histogram.end(), scanned.begin());
+				scanHostUs[i] = min(scanHostUs[i], duration<double, micro>(high_resolution_clock::now() - start).count());
+
+				start = high_resolution_clock::now();
+				CumulativeSumParallel(kernels, pool, queue, histogram, ignoredDurationMs, SCAN_AUTO);
+				scanDeviceUs[i] = min(scanDeviceUs[i], duration<double, micro>(high_resolution_clock::now() - start).count());
+
+				start = high_resolution_clock::now();
+				EventList hostEvents;
+				ScanAndNormaliseOnHost<cl_uint, cl_ushort>(queue, histogramBuffer, lutBuffer, static_cast<unsigned int>(count), 1, 65535, hostEvents);
+				normaliseHostUs[i] = min(normaliseHostUs[i], duration<double, micro>(high_resolution_clock::now() - start).count());
+
+				start = high_resolution_clock::now();
+				EventList deviceEvents;
+				CumulativeSumBuffer<cl_uint>(kernels, pool, queue, histogramBuffer, cumulativeBuffer, count, deviceEvents, SCAN_AUTO);
+				const vector<cl::Event> lutWaitList = After(deviceEvents);
+				queue.enqueueNDRangeKernel(lutKernel, cl::NullRange, cl::NDRange(count, 1), cl::NullRange, &lutWaitList);
+				queue.finish();
+				normaliseDeviceUs[i] = min(normaliseDeviceUs[i], duration<double, micro>(high_resolution_clock::now() - start).count());
+			}
+		}
+
+		DispatchModel model;
+		model.Scan = FitCosts(counts, scanHostUs, scanDeviceUs);
+		model.ScanAndNormalise = FitCosts(counts, normaliseHostUs, normaliseDeviceUs);
+		return model;
+	}
+
+	// Fit a fixed cost and a cost per element through the timings at the two sizes, neither may be negative.
+	static DispatchCosts FitCosts(const size_t counts[2], const double hostUs[2], const double deviceUs[2]) {
+		DispatchCosts costs;
+		const double countDifference = static_cast<double>(counts[1] - counts[0]);
+		costs.HostPerElementUs = max(0.0, (hostUs[1] - hostUs[0]) / countDifference);
+		costs.HostFixedUs = max(0.0, hostUs[0] - costs.HostPerElementUs * counts[0]);
+		costs.DevicePerElementUs = max(0.0, (deviceUs[1] - deviceUs[0]) / countDifference);
+		costs.DeviceFixedUs = max(0.0, deviceUs[0] - costs.DevicePerElementUs * counts[0]);
+		return costs;
+	}
+
+	// The number of elements each work item of the single group scan handles, must match SCAN_ITEMS_PER_THREAD in SharedKernels.cl.
+	static const unsigned int ScanItemsPerThread = 8;
+
+	// Round a count up to a whole number of blocks.
+	static size_t RoundUp(const size_t count, const size_t blockSize) {
+		return ((count + blockSize - 1) / blockSize) * blockSize;
+	}
 
-		// Run the block scan kernel.
-		queue.enqueueNDRangeKernel(phase2ScanKernel, cl::NullRange, cl::NDRange(numberOfGroups), cl::NullRange, NULL, &perfEventPhase2Scan);
+	// Copy count elements of a device buffer back to the host once the last of the events has finished.
+	template <typename CountType>
+	static vector<CountType> ReadBuffer(const cl::CommandQueue& queue, const cl::Buffer& buffer, const size_t count, const EventList& events) {
+		vector<CountType> data(count);
+		const vector<cl::Event> waitList = After(events);
+		queue.enqueueReadBuffer(buffer, CL_TRUE, 0, count * sizeof(CountType), &data[0], &waitList);
+		return data;
+	}
+
+	// Scan on the host, for devices that can't run the scan kernels with more than one work item per group.
+	template <typename CountType>
+	static void ScanOnHost(const cl::CommandQueue& queue, const cl::Buffer& input, const cl::Buffer& output, const size_t count, EventList& events) {
+		cout << "\tDevice only supports single work item groups, scanning on the host." << endl;
+		vector<CountType> data = ReadBuffer<CountType>(queue, input, count, events);
+		partial_sum(data.begin(), data.end(), data.begin());
+
+		cl::Event writeEvent;
+		queue.enqueueWriteBuffer(output, CL_TRUE, 0, count * sizeof(CountType), &data[0], NULL, &writeEvent);
+		events.push_back(make_pair(string("Write Host Scan"), writeEvent));
+	}
+
+	// Scan with a multi-level scan using the given algorithm for each block, either Hillis-Steele or Blelloch.
+	template <typename CountType>
+	static void Scan(KernelRegistry& kernels, BufferPool& pool, const cl::CommandQueue& queue, const cl::Buffer& input, const cl::Buffer& output, const size_t count, const ScanAlgorithm algorithm, EventList& events) {
+		const bool blelloch = algorithm == SCAN_BLELLOCH;
+		const string kernelName = blelloch ? "scanBlelloch" : "scanHillisSteeleBuffered";
 
-		// Create a kernel for adjusting the original partial scan with the new block scan result.
-		cl::Kernel phase3Kernel = cl::Kernel(program, "scanAddAdjust");
+		const size_t localSize = kernels.GetPowerOfTwoLocalSize(kernelName);
 
-		// Input the original partial scan result.
-		phase3Kernel.setArg(0, outputBuffer);
-		// Input the block scan result.
-		phase3Kernel.setArg(1, phase2OutputBuffer);
+		// Some CPU runtimes only allow single work item groups for kernels with barriers, the levels would never shrink.
+		if (localSize < 2) {
+			ScanOnHost<CountType>(queue, input, output, count, events);
+			return;
+		}
+
+		// Each Blelloch work item scans two elements.
+		const size_t blockSize = blelloch ? localSize * 2 : localSize;
+
+		// The block scans read whole blocks, so arrays that don't fill their last block are scanned in zero padded copies on the device.
+		const size_t paddedCount = RoundUp(count, blockSize);
+		if (paddedCount == count) {
+			ScanLevel<CountType>(kernels, pool, queue, kernelName, input, output, count, localSize, blockSize, 0, events);
+		}
+		else {
+			const size_t size = count * sizeof(CountType);
+			const size_t paddedSize = paddedCount * sizeof(CountType);
+			const PooledBuffer paddedInput = pool.Acquire(paddedSize);
+			const PooledBuffer paddedOutput = pool.Acquire(paddedSize);
+
+			// Zeros are used because they don't affect the sum.
+			const vector<cl::Event> copyInWaitList = After(events);
+			cl::Event copyInEvent;
+			queue.enqueueCopyBuffer(input, paddedInput, 0, 0, size, &copyInWaitList, &copyInEvent);
+			events.push_back(make_pair(string("Scan Copy In"), copyInEvent));
+
+			const vector<cl::Event> fillWaitList = After(events);
+			cl::Event fillEvent;
+			queue.enqueueFillBuffer(paddedInput, static_cast<CountType>(0), size, paddedSize - size, &fillWaitList, &fillEvent);
+			events.push_back(make_pair(string("Scan Padding"), fillEvent));
+
+			ScanLevel<CountType>(kernels, pool, queue, kernelName, paddedInput, paddedOutput, paddedCount, localSize, blockSize, 0, events);
+
+			// Leave the padding behind.
+			const vector<cl::Event> copyOutWaitList = After(events);
+			cl::Event copyOutEvent;
+			queue.enqueueCopyBuffer(paddedOutput, output, 0, 0, size, &copyOutWaitList, &copyOutEvent);
+			events.push_back(make_pair(string("Scan Copy Out"), copyOutEvent));
+		}
+	}
+
+	// Check whether the whole array can be scanned by a single work group.
+	static bool FitsSingleGroup(KernelRegistry& kernels, const size_t count) {
+		return count <= kernels.GetPowerOfTwoLocalSize("scanSingleGroup") * ScanItemsPerThread;
+	}
+
+	// Scan an array that fits in a single work group with one launch, no other buffers are needed.
+	template <typename CountType>
+	static void ScanSingleGroup(KernelRegistry& kernels, const cl::CommandQueue& queue, const cl::Buffer& input, const cl::Buffer& output, const size_t count, EventList& events) {
+		// Use the smallest power of two work group that covers the array.
+		const size_t runs = (count + ScanItemsPerThread - 1) / ScanItemsPerThread;
+		size_t localSize = 1;
+		while (localSize < runs) {
+			localSize *= 2;
+		}
+
+		cl::Kernel& scanKernel = kernels.Get("scanSingleGroup");
+		scanKernel.setArg(0, input);
+		scanKernel.setArg(1, output);
+		scanKernel.setArg(2, static_cast<unsigned int>(count));
+		scanKernel.setArg(3, cl::Local(localSize * sizeof(CountType)));
 
 		// Create  an event for performance tracking.
-		cl::Event perfEventPhase3;
+		const vector<cl::Event> waitList = After(events);
+		cl::Event perfEvent;
 
-		size_t phase3GlobalSize = inputCount - localSize;
+		queue.enqueueNDRangeKernel(scanKernel, cl::NullRange, cl::NDRange(localSize), cl::NDRange(localSize), &waitList, &perfEvent);
+		events.push_back(make_pair(string("Single Work Group Scan"), perfEvent));
+	}
 
-		// Correction for when number of bins is less than local size.
-		if (phase3GlobalSize <= 0) {
-			phase3GlobalSize = inputCount;
+	// Scan in a single launch with decoupled look-back, the input is read and the output written only once.
+	// Work groups spin while waiting on earlier tiles. OpenCL 1.2 doesn't promise that running work groups make progress,
+	// but tiles are numbered in the order work groups start so none of them waits on a tile that hasn't been scheduled.
+	template <typename CountType>
+	static void ScanSinglePass(KernelRegistry& kernels, BufferPool& pool, const cl::CommandQueue& queue, const cl::Buffer& input, const cl::Buffer& output, const size_t count, EventList& events) {
+		const size_t localSize = kernels.GetPowerOfTwoLocalSize("scanDecoupledLookback");
+
+		// The look-back is done by a single work item, so there must be more than one per group for the tiles to shrink the work.
+		if (localSize < 2) {
+			ScanOnHost<CountType>(queue, input, output, count, events);
+			return;
 		}
 
-		// Run the scan add kernel.
-		queue.enqueueNDRangeKernel(phase3Kernel, cl::NDRange(localSize), cl::NDRange(phase3GlobalSize), cl::NDRange(localSize), NULL, &perfEventPhase3);
+		const size_t tileCount = RoundUp(count, localSize) / localSize;
 
-		// Create an output vector of the right size.
-		vector<unsigned int> outputData(outputCount);
+		// The tile counter followed by the state of every tile, these must start at zero. The tile totals and prefixes don't need clearing.
+		const size_t tileStatusBytes = (tileCount + 1) * sizeof(unsigned int);
+		const PooledBuffer tileStatusBuffer = pool.Acquire(tileStatusBytes);
+		const PooledBuffer tileValuesBuffer = pool.Acquire(tileCount * 2 * sizeof(CountType));
 
-		// Copy the contents of the output buffer on the device to the vector on the host.
-		queue.enqueueReadBuffer(outputBuffer, CL_TRUE, 0, outputSize, &outputData[0]);
+		const vector<cl::Event> fillWaitList = After(events);
+		cl::Event fillEvent;
+		queue.enqueueFillBuffer(tileStatusBuffer, static_cast<unsigned int>(0), 0, tileStatusBytes, &fillWaitList, &fillEvent);
+		events.push_back(make_pair(string("Clear Tile Status"), fillEvent));
 
-		// Print out the performance values.
-		cout << "\t\tDouble Buffered Hillis-Steele Scan: " << GetFullProfilingInfo(perfEventPhase1, ProfilingResolution::PROF_US) << endl;
-		cout << "\t\tBlock Sum: " << GetFullProfilingInfo(perfEventPhase2, ProfilingResolution::PROF_US) << endl;
-		cout << "\t\tBlock Scan: " << GetFullProfilingInfo(perfEventPhase2Scan, ProfilingResolution::PROF_US) << endl;
-		cout << "\t\tScan Add: " << GetFullProfilingInfo(perfEventPhase3, ProfilingResolution::PROF_US) << endl;
-		totalDurationMs += GetProfilingTotalTimeMs(perfEventPhase1);
-		totalDurationMs += GetProfilingTotalTimeMs(perfEventPhase2);
-		totalDurationMs += GetProfilingTotalTimeMs(perfEventPhase2Scan);
-		totalDurationMs += GetProfilingTotalTimeMs(perfEventPhase3);
+		cl::Kernel& scanKernel = kernels.Get("scanDecoupledLookback");
+		scanKernel.setArg(0, input);
+		scanKernel.setArg(1, output);
+		scanKernel.setArg(2, static_cast<CountType>(count));
+		scanKernel.setArg(3, tileStatusBuffer);
+		scanKernel.setArg(4, tileValuesBuffer);
+		scanKernel.setArg(5, cl::Local(localSize * sizeof(CountType)));
 
-		return outputData;
+		// Create  an event for performance tracking.
+		const vector<cl::Event> scanWaitList = After(events);
+		cl::Event perfEvent;
+
+		// Run the whole scan in one launch.
+		queue.enqueueNDRangeKernel(scanKernel, cl::NullRange, cl::NDRange(tileCount * localSize), cl::NDRange(localSize), &scanWaitList, &perfEvent);
+		events.push_back(make_pair(string("Single Pass Decoupled Look-Back Scan"), perfEvent));
+	}
+
+	// Scan count elements from input into output, count must be a multiple of blockSize.
+	// Each block is scanned on its own, then the last element of every block is scanned by recursing on the block sums
+	// and added back to the following blocks. Each level is blockSize times smaller than the last, so any size of array can be scanned.
+	template <typename CountType>
+	static void ScanLevel(KernelRegistry& kernels, BufferPool& pool, const cl::CommandQueue& queue, const string& kernelName, const cl::Buffer& input, const cl::Buffer& output, const size_t count, const size_t localSize, const size_t blockSize, const unsigned int level, EventList& events) {
+		const string levelName = "Scan Level " + to_string(level) + " ";
+
+		// Create the kernel for the scan of each block.
+		cl::Kernel& scanKernel = kernels.Get(kernelName);
+		scanKernel.setArg(0, input);
+		scanKernel.setArg(1, output);
+		if (blockSize == localSize) {
+			// Hillis-Steele double buffers the block.
+			scanKernel.setArg(2, cl::Local(localSize * sizeof(CountType)));
+			scanKernel.setArg(3, cl::Local(localSize * sizeof(CountType)));
+		}
+		else {
+			// Blelloch scans in place, with a padding slot every 32 elements to avoid bank conflicts.
+			scanKernel.setArg(2, cl::Local((blockSize + blockSize / 32) * sizeof(CountType)));
+		}
+
+		const vector<cl::Event> scanWaitList = After(events);
+		cl::Event scanEvent;
+		queue.enqueueNDRangeKernel(scanKernel, cl::NullRange, cl::NDRange(count / blockSize * localSize), cl::NDRange(localSize), &scanWaitList, &scanEvent);
+		events.push_back(make_pair(levelName + (blockSize == localSize ? "Double Buffered Hillis-Steele Scan" : "Blelloch Scan"), scanEvent));
+
+		// A single block is fully scanned already, this is the last level.
+		const size_t numberOfBlocks = count / blockSize;
+		if (numberOfBlocks == 1) {
+			return;
+		}
+
+		// The block sums are padded to whole blocks so the next level can scan them, the padding must be zero.
+		const size_t blockSumCount = RoundUp(numberOfBlocks, blockSize);
+		const size_t blockSumBytes = blockSumCount * sizeof(CountType);
+		const PooledBuffer blockSumBuffer = pool.Acquire(blockSumBytes);
+		const PooledBuffer blockScanBuffer = pool.Acquire(blockSumBytes);
+
+		const vector<cl::Event> fillWaitList = After(events);
+		cl::Event fillEvent;
+		queue.enqueueFillBuffer(blockSumBuffer, static_cast<CountType>(0), 0, blockSumBytes, &fillWaitList, &fillEvent);
+		events.push_back(make_pair(levelName + "Clear Block Sums", fillEvent));
+
+		// Take the last element of every scanned block.
+		cl::Kernel& blockSumKernel = kernels.Get("blockSum");
+		blockSumKernel.setArg(0, output);
+		blockSumKernel.setArg(1, blockSumBuffer);
+		blockSumKernel.setArg(2, static_cast<unsigned int>(blockSize));
+
+		const vector<cl::Event> blockSumWaitList = After(events);
+		cl::Event blockSumEvent;
+		queue.enqueueNDRangeKernel(blockSumKernel, cl::NullRange, cl::NDRange(numberOfBlocks), cl::NullRange, &blockSumWaitList, &blockSumEvent);
+		events.push_back(make_pair(levelName + "Block Sum", blockSumEvent));
+
+		// Scan the block sums on the next level down.
+		ScanLevel<CountType>(kernels, pool, queue, kernelName, blockSumBuffer, blockScanBuffer, blockSumCount, localSize, blockSize, level + 1, events);
+
+		// Add the scanned block sums to every block after the first.
+		cl::Kernel& addKernel = kernels.Get("scanAddAdjust");
+		addKernel.setArg(0, output);
+		addKernel.setArg(1, blockScanBuffer);
+		addKernel.setArg(2, static_cast<unsigned int>(blockSize));
+
+		const vector<cl::Event> addWaitList = After(events);
+		cl::Event addEvent;
+		queue.enqueueNDRangeKernel(addKernel, cl::NDRange(blockSize), cl::NDRange(count - blockSize), cl::NullRange, &addWaitList, &addEvent);
+		events.push_back(make_pair(levelName + "Scan Add", addEvent));
 	}
 };
@@ -4,6 +4,8 @@
 #include <vector>
 #include <iostream>
 #include <sstream>
+#include <stdexcept>
+#include <cctype>
 
 #define CL_USE_DEPRECATED_OPENCL_1_2_APIS
 #define CL_HPP_MINIMUM_OPENCL_VERSION 120
@@ -123,11 +125,160 @@ void CheckError(cl_int error) {
 	}
 }
 
+// Reads a kernel source file into the program sources, throwing if it can't be read rather than building an empty program.
 void AddSources(cl::Program::Sources& sources, const string& file_name) {
-	//TODO: add file existence check
 	ifstream file(file_name);
-	string* source_code = new string(istreambuf_iterator<char>(file), (istreambuf_iterator<char>()));
-	sources.push_back((*source_code).c_str());
+	if (!file) {
+		throw runtime_error("Could not open kernel source " + file_name);
+	}
+	sources.push_back(string(istreambuf_iterator<char>(file), (istreambuf_iterator<char>())));
+}
+
+// Builds a program from the given sources with the given build options, printing the build log if it fails.
+cl::Program BuildProgram(const cl::Context& context, const cl::Program::Sources& sources, const string& options) {
+	cl::Program program(context, sources);
+
+	// Build and debug the kernel code
+	try {
+		program.build(options.c_str());
+	}
+	catch (const cl::Error & err) {
+		std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+		std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+		std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+		throw err;
+	}
+
+	return program;
+}
+
+// A 64-bit FNV-1a hash. Unlike std::hash it is the same on every run and compiler, so it can be used in file names.
+unsigned long long HashString(const string& text, unsigned long long hash = 14695981039346656037ULL) {
+	for (const char c : text) {
+		hash ^= static_cast<unsigned char>(c);
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// Builds a program like BuildProgram, but reuses the device binary saved by an earlier run when the platform, device, driver, build options and sources all match.
+// Binaries are saved in the working directory after every build from source. A missing, stale or rejected binary just means building from source again.
+cl::Program BuildProgramCached(const cl::Context& context, const cl::Program::Sources& sources, const string& options, bool& loadedFromCache) {
+	const cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	const cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+
+	// Anything that could make a saved binary wrong for this build goes in the key.
+	unsigned long long sourceHash = HashString("");
+	for (const string& source : sources) {
+		sourceHash = HashString(source, sourceHash);
+	}
+	stringstream keyStream;
+	keyStream << platform.getInfo<CL_PLATFORM_NAME>() << " " << platform.getInfo<CL_PLATFORM_VERSION>() << " / " << device.getInfo<CL_DEVICE_NAME>()
+		<< " / " << device.getInfo<CL_DRIVER_VERSION>() << " / " << options << " / " << hex << sourceHash;
+	const string key = keyStream.str();
+
+	stringstream fileName;
+	fileName << "kernels_" << hex << HashString(key) << ".bin";
+
+	// The file starts with the whole key, so two keys with the same hash can't load each other's binary.
+	ifstream cacheIn(fileName.str(), ios::binary);
+	string savedKey;
+	if (getline(cacheIn, savedKey) && savedKey == key) {
+		const cl::Program::Binaries binaries(1, vector<unsigned char>(istreambuf_iterator<char>(cacheIn), (istreambuf_iterator<char>())));
+		try {
+			cl::Program program(context, vector<cl::Device>(1, device), binaries);
+			program.build(options.c_str());
+			loadedFromCache = true;
+			return program;
+		}
+		catch (const cl::Error&) {
+			// The driver rejected the binary, it is replaced by the source build below.
+		}
+	}
+	cacheIn.close();
+
+	cl::Program program = BuildProgram(context, sources, options);
+	loadedFromCache = false;
+
+	// Save the binary for the next run, failing to write it only means building from source again.
+	const cl::Program::Binaries binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+	if (!binaries.empty() && !binaries[0].empty()) {
+		ofstream cacheOut(fileName.str(), ios::binary);
+		cacheOut << key << '\n';
+		cacheOut.write(reinterpret_cast<const char*>(binaries[0].data()), binaries[0].size());
+	}
+
+	return program;
+}
+
+// The project builds against the OpenCL 1.2 API, so the 3.0 query for optional OpenCL C features is defined here.
+#ifndef CL_DEVICE_OPENCL_C_FEATURES
+#define CL_DEVICE_OPENCL_C_FEATURES 0x106F
+#endif
+
+// Get the major version from a version string such as "OpenCL 3.0 <vendor-specific information>" or "OpenCL C 1.2 <vendor-specific information>".
+int GetMajorVersion(const string& version) {
+	istringstream words(version);
+	string word;
+	while (words >> word) {
+		// The version is the first word that starts with a digit.
+		if (isdigit(static_cast<unsigned char>(word[0]))) {
+			int major = 1;
+			istringstream(word) >> major;
+			return major;
+		}
+	}
+	return 1;
+}
+
+// Check whether the device supports an optional OpenCL C 3.0 feature, e.g. __opencl_c_subgroups. Devices older than 3.0 have none.
+bool HasOpenCLCFeature(const cl::Device& device, const string& feature) {
+	if (GetMajorVersion(device.getInfo<CL_DEVICE_VERSION>()) < 3) {
+		return false;
+	}
+
+	// Each feature is reported as a cl_name_version, a packed version followed by a fixed-size name.
+	struct NameVersion {
+		cl_uint Version;
+		char Name[64];
+	};
+
+	size_t size = 0;
+	if (clGetDeviceInfo(device(), CL_DEVICE_OPENCL_C_FEATURES, 0, nullptr, &size) != CL_SUCCESS) {
+		return false;
+	}
+	vector<NameVersion> features(size / sizeof(NameVersion));
+	if (features.empty() || clGetDeviceInfo(device(), CL_DEVICE_OPENCL_C_FEATURES, features.size() * sizeof(NameVersion), features.data(), nullptr) != CL_SUCCESS) {
+		return false;
+	}
+
+	for (const NameVersion& nameVersion : features) {
+		if (feature == nameVersion.Name) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Get the OpenCL C standard option for the device, so kernels can use work group collectives and sub-groups when it has them.
+// The kernels check for each feature themselves, devices that only support OpenCL C 1.2 get no option and the 1.2 kernels.
+string GetLanguageBuildOptions(const cl::Device& device) {
+	// 3.0 devices report the newest OpenCL C they support in full, usually 1.2, and list what they have of 3.0 as optional features.
+	// Only those features make building for 3.0 worthwhile.
+	if (HasOpenCLCFeature(device, "__opencl_c_work_group_collective_functions") || HasOpenCLCFeature(device, "__opencl_c_subgroups")) {
+		return "-cl-std=CL3.0";
+	}
+
+	// The version is reported as "OpenCL C <major>.<minor> <vendor-specific information>", 2.0 has both in full.
+	if (GetMajorVersion(device.getInfo<CL_DEVICE_OPENCL_C_VERSION>()) == 2) {
+		return "-cl-std=CL2.0";
+	}
+	return "";
+}
+
+// Check whether the device supports sub-groups, from the cl_khr_subgroups extension or as an OpenCL C 3.0 feature.
+bool HasSubGroups(const cl::Device& device) {
+	return device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_subgroups") != string::npos || HasOpenCLCFeature(device, "__opencl_c_subgroups");
 }
 
 string ListPlatformsDevices() {
@@ -228,4 +379,9 @@ string GetFullProfilingInfo(const cl::Event& evnt, ProfilingResolution resolutio
 
 double GetProfilingTotalTimeMs(const cl::Event& evnt) {
 	return (evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>()) / static_cast<double>(ProfilingResolution::PROF_MS);
+}
+
+// Only the time the command spent running, not the time it waited in the queue behind earlier commands.
+double GetProfilingExecutionTimeMs(const cl::Event& evnt) {
+	return (evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>()) / static_cast<double>(ProfilingResolution::PROF_MS);
 }
\ No newline at end of file